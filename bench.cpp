@@ -0,0 +1,203 @@
+// Microbenchmarks for the Kaleidoscope compiler: lexer throughput, parsing of
+// deep and wide expressions, codegen per AST node and end-to-end compilation
+// of a large generated corpus. Build and run with `make bench && ./bench`.
+
+#define LANG_NO_MAIN
+#include "lang.cpp"
+
+#include "workload.h"
+#include <benchmark/benchmark.h>
+
+
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+//--------------------------------------------------------------------------------
+// SYNTHETIC INPUTS
+//--------------------------------------------------------------------------------
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+
+/// x+(x*1.5+(x+(...))) nested `depth` levels deep through parentheses.
+static std::string make_deep_expression (int depth) {
+    std::string expr;
+    for (int level = 0; level != depth; ++level)
+        expr += (level % 2) ? "x*" + std::to_string (level) + ".5+(" : "x+(";
+
+    expr += "x";
+    expr.append (depth, ')');
+    return expr;
+}
+
+/// x0*1.5 + x1*2.5 + ... with `width` terms at the same nesting level.
+static std::string make_wide_expression (int width) {
+    std::string expr;
+    for (int term = 0; term != width; ++term) {
+        if (term)
+            expr += term % 3 ? " + " : " - ";
+        expr += "x" + std::to_string (term % 8) + "*" + std::to_string (term) + ".5";
+    }
+    return expr;
+}
+
+/// A generated program of `num_defs` definitions, or of about `size` bytes if
+/// that is set. Each def calls its parent in a binary tree, so the call graph
+/// is log2(num_defs) deep and the inliner's work stays bounded.
+static std::string make_corpus (uint64_t num_defs, uint64_t size = 0) {
+    workload::Options options;
+    options.num_defs = num_defs;
+    options.target_size = size;
+    options.fanout = 1;
+    options.call_graph = workload::CallGraphShape::Tree;
+
+    std::string source;
+    raw_string_ostream out (source);
+    workload::generate (options, out);
+    return out.str ();
+}
+
+static std::unique_ptr<MemoryBuffer> make_buffer (const std::string &source) {
+    return MemoryBuffer::getMemBuffer (source, "bench", /*RequiresNullTerminator=*/true);
+}
+
+static TargetMachine &get_host_target_machine () {
+    static std::unique_ptr<TargetMachine> machine = exit_on_err (
+        exit_on_err (orc::JITTargetMachineBuilder::detectHost ()).createTargetMachine ());
+    return *machine;
+}
+
+
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+//--------------------------------------------------------------------------------
+// BENCHMARKS
+//--------------------------------------------------------------------------------
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+
+/// Tokens per second over generated sources of range(0) bytes.
+static void BM_Lexer (benchmark::State &state) {
+    std::string source = make_corpus (0, state.range (0));
+    Lexer lexer;
+    uint64_t tokens = 0;
+
+    for (auto _ : state) {
+        lexer.set_source (make_buffer (source));
+
+        int token;
+        do {
+            token = lexer.get_token ();
+            benchmark::DoNotOptimize (token);
+            ++tokens;
+        } while (token != TOK_EOF);
+    }
+
+    state.SetBytesProcessed (state.iterations () * source.size ());
+    state.counters["tokens/s"] = benchmark::Counter (tokens, benchmark::Counter::kIsRate);
+}
+BENCHMARK (BM_Lexer)->RangeMultiplier (32)->Range (1 << 10, 32 << 20);
+
+/// Parses one expression into a function body; range(1) selects the flat AST.
+static void parse_expression_benchmark (benchmark::State &state, const std::string &expr) {
+    Lexer lexer;
+    Parser parser (lexer);
+    parser.set_flat_ast (state.range (1));
+
+    for (auto _ : state) {
+        lexer.set_source (make_buffer (expr));
+        parser.get_next_token ();
+
+        auto function = parser.parse_toplevel_expression ();
+        if (!function) {
+            state.SkipWithError ("parse failed");
+            return;
+        }
+        benchmark::DoNotOptimize (function.get ());
+    }
+
+    state.SetBytesProcessed (state.iterations () * expr.size ());
+    state.counters["nodes"] = parser.get_num_ast_nodes () / state.iterations ();
+}
+
+static void BM_ParseDeep (benchmark::State &state) {
+    parse_expression_benchmark (state, make_deep_expression (state.range (0)));
+}
+BENCHMARK (BM_ParseDeep)->ArgsProduct ({{16, 256, 2048}, {0, 1}});
+
+static void BM_ParseWide (benchmark::State &state) {
+    parse_expression_benchmark (state, make_wide_expression (state.range (0)));
+}
+BENCHMARK (BM_ParseWide)->ArgsProduct ({{16, 1024, 16384}, {0, 1}});
+
+/// IR generation for one wide definition at -O0, reported per AST node.
+static void BM_CodegenPerNode (benchmark::State &state) {
+    std::string source = "def f(x0 x1 x2 x3 x4 x5 x6 x7) " + make_wide_expression (state.range (0));
+
+    Lexer lexer;
+    Parser parser (lexer);
+    parser.set_flat_ast (state.range (1));
+    lexer.set_source (make_buffer (source));
+    parser.get_next_token ();
+
+    auto function = parser.parse_definition ();
+    if (!function) {
+        state.SkipWithError ("parse failed");
+        return;
+    }
+
+    PrototypeMap protos;
+    CodeGenContext ctx (protos, &get_host_target_machine (), OptimizationLevel::O0);
+    Symbol name = lexer.get_symbols ().intern ("f");
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize (function->codegen (ctx));
+        ctx.erase_function (name);
+    }
+
+    state.SetItemsProcessed (state.iterations () * parser.get_num_ast_nodes ());
+    state.SetLabel ("items = AST nodes");
+}
+BENCHMARK (BM_CodegenPerNode)->ArgsProduct ({{64, 4096}, {0, 1}});
+
+/// Parse, codegen, optimize and emit an object file for 10k definitions;
+/// range(0) is the -O level.
+static void BM_CompileCorpus (benchmark::State &state) {
+    static const std::string source = make_corpus (10000);
+
+    CompilerOptions options;
+    options.compile_only = true;
+    options.output_level = OutputLevel::Silent;
+    options.opt_level = state.range (0) ? OptimizationLevel::O2 : OptimizationLevel::O0;
+    options.codegen_opt_level = state.range (0) ? CodeGenOpt::Default : CodeGenOpt::None;
+
+    SmallString<128> object_path;
+    if (sys::fs::createTemporaryFile ("lang-bench", "o", object_path)) {
+        state.SkipWithError ("could not create a temporary file");
+        return;
+    }
+
+    for (auto _ : state) {
+        Compiler compiler (options);
+        compiler.get_lexer ().set_source (make_buffer (source));
+        compiler.main_loop ();
+        if (!compiler.emit_object (object_path)) {
+            state.SkipWithError ("emitting the object file failed");
+            break;
+        }
+    }
+
+    sys::fs::remove (object_path);
+    state.SetBytesProcessed (state.iterations () * source.size ());
+    state.SetItemsProcessed (state.iterations () * 10000);
+    state.SetLabel ("items = definitions");
+}
+BENCHMARK (BM_CompileCorpus)->Arg (0)->Arg (2)->Unit (benchmark::kMillisecond)->Iterations (1);
+
+int main (int argc, char **argv) {
+    InitializeNativeTarget ();
+    InitializeNativeTargetAsmPrinter ();
+    InitializeNativeTargetAsmParser ();
+
+    benchmark::Initialize (&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments (argc, argv))
+        return 1;
+
+    benchmark::RunSpecifiedBenchmarks ();
+    benchmark::Shutdown ();
+    return 0;
+}
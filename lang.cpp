@@ -1,25 +1,194 @@
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/Transforms/Vectorize/SLPVectorizer.h"
 #include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <cctype>
+#include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 using namespace llvm;
 
+static cl::opt<char> opt_level (
+    "O",
+    cl::desc ("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
+    cl::Prefix, cl::ZeroOrMore, cl::init ('2'));
+
+static cl::opt<bool> flat_ast (
+    "flat-ast",
+    cl::desc ("Parse expressions into the flat, index-linked AST instead of ExprAST nodes"),
+    cl::init (false));
+
+static cl::opt<bool> fast_math (
+    "fast-math",
+    cl::desc ("Allow simplifications that ignore signed zeros, such as x+0 -> x and x*1 -> x"),
+    cl::init (false));
+
+static cl::opt<std::string> input_filename (
+    cl::Positional, cl::desc ("<input file>"), cl::init ("-"));
+
+static cl::opt<std::string> cache_dir (
+    "cache-dir",
+    cl::desc ("Keep compiled definitions in this directory and reuse them across runs"),
+    cl::value_desc ("directory"));
+
+static cl::opt<bool> lazy (
+    "lazy",
+    cl::desc ("Compile each definition on its first call instead of when it is parsed"),
+    cl::init (false));
+
+static cl::opt<bool> interpret (
+    "interpret",
+    cl::desc ("Run definitions and top-level expressions in the bytecode interpreter "
+              "instead of compiling them with LLVM"),
+    cl::init (false));
+
+static cl::opt<unsigned> tier_up (
+    "tier-up",
+    cl::desc ("Interpret definitions first (implies --interpret) and recompile one with -O3 "
+              "on a background thread once it has been called this many times"),
+    cl::value_desc ("calls"), cl::init (0));
+
+static cl::opt<bool> batch (
+    "batch",
+    cl::desc ("Also emit void <name>_batch(const double *args..., double *out, size_t n) "
+              "evaluating each definition over whole columns"),
+    cl::init (false));
+
+static cl::opt<unsigned> jobs (
+    "j",
+    cl::desc ("Parse the whole input first, then generate code for its definitions on "
+              "this many threads (0 = one per hardware thread)"),
+    cl::value_desc ("threads"), cl::Prefix, cl::init (1));
+
+static cl::opt<bool> async_compile (
+    "async",
+    cl::desc ("Compile definitions on a pool of -j threads while the input is still being "
+              "read; running code waits only for the definitions it calls"),
+    cl::init (false));
+
+static cl::opt<bool> compile_only (
+    "c",
+    cl::desc ("Compile the whole input to a native object file instead of running it"),
+    cl::init (false));
+
+static cl::opt<std::string> output_filename (
+    "o", cl::desc ("Object file to write with -c (default: <input>.o)"),
+    cl::value_desc ("filename"));
+
+static cl::opt<unsigned> max_errors (
+    "max-errors",
+    cl::desc ("Stop reading a file after this many errors (0 = no limit, default = 20)"),
+    cl::init (20));
+
+enum class OutputLevel { Silent, Summary, IR };
+
+static cl::opt<OutputLevel> output_level (
+    "output",
+    cl::desc ("What to print while compiling (default = ir)"),
+    cl::values (
+        clEnumValN (OutputLevel::Silent, "silent", "Only errors and warnings"),
+        clEnumValN (OutputLevel::Summary, "summary",
+                    "Also progress messages and evaluated values, but no IR"),
+        clEnumValN (OutputLevel::IR, "ir", "Also the IR of every function and the final module")),
+    cl::init (OutputLevel::IR));
+
+static cl::opt<bool> time_report (
+    "time-report",
+    cl::desc ("Print the time spent in each compile phase and compile statistics"),
+    cl::init (false));
+
+static cl::opt<std::string> time_trace (
+    "time-trace",
+    cl::desc ("Write a Chrome trace (chrome://tracing) of the compile phases to this file"),
+    cl::value_desc ("filename"));
+
+static ExitOnError exit_on_err;
+
+// Record every event in --time-trace output; definitions are coarse enough.
+static const unsigned time_trace_granularity = 0;
+
+namespace {
+
+// Per-phase timers for --time-report. Timers are not thread-safe, so only the
+// main thread's work is timed; -j workers show up in --time-trace instead.
+struct PhaseTimers {
+    TimerGroup group {"lang", "Kaleidoscope compile time report"};
+    // The lexer runs on demand from the parser, so its time is part of this.
+    Timer parse {"parse", "Lexing and parsing", group};
+    Timer codegen {"codegen", "IR generation", group};
+    Timer verify {"verify", "IR verification", group};
+    Timer optimize {"optimize", "Optimization passes", group};
+    Timer bytecode {"bytecode", "Bytecode compilation", group};
+    Timer print {"print", "IR printing", group};
+};
+
+}
+
+/// The timer for `phase`, or null (which TimeRegion ignores) when timing is off.
+static Timer *phase_timer (PhaseTimers *timers, Timer PhaseTimers::*phase) {
+    return timers ? &(timers->*phase) : nullptr;
+}
+
 
 //flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
 //--------------------------------------------------------------------------------
@@ -37,536 +206,3231 @@ enum Tokens {
     TOK_NUMBER      = -5
 };
 
-static std::string identifier_str;
-static double num_val;
+namespace {
 
-static int get_token() {
-    static int last_char = ' ';
+// An interned identifier: a handle to the single copy of its spelling kept by
+// a SymbolTable. Symbols compare and hash by pointer, and their dense id can
+// index per-symbol side tables. Reading a Symbol never touches the table, so
+// handles stay usable from other threads while the table keeps growing.
+class Symbol {
+    const StringMapEntry<uint32_t> *entry = nullptr;
 
-    while (isspace(last_char))
-        last_char = getchar ();
+    public:
+        Symbol () = default;
+        explicit Symbol (const StringMapEntry<uint32_t> *entry): entry (entry) {}
 
-    if (isalpha (last_char)) {
-        identifier_str = last_char;
-        
-        while (isalnum (last_char = getchar ()))
-            identifier_str += last_char;
+        StringRef str () const { return entry->getKey (); }
+        uint32_t id () const { return entry->getValue (); }
 
-        if (identifier_str == "def")
-            return TOK_DEF;
-        
-        if (identifier_str == "extern")
-            return TOK_EXTERN;
-        
-        return TOK_IDENTIFIER;
-    }
+        const void *get_opaque_value () const { return entry; }
+        static Symbol get_from_opaque_value (const void *value) {
+            return Symbol (static_cast<const StringMapEntry<uint32_t> *> (value));
+        }
 
+        explicit operator bool () const { return entry != nullptr; }
+        bool operator== (Symbol other) const { return entry == other.entry; }
+        bool operator!= (Symbol other) const { return entry != other.entry; }
+};
 
-    if (isdigit (last_char) || last_char == '.') {
-        std::string number_str;
-        int num_points = 0;
+class SymbolTable {
+    StringMap<uint32_t, BumpPtrAllocator> symbols;
 
-        do {
-            number_str += last_char;
-            last_char = getchar ();
-            
-            if (last_char == '.')
-                num_points += 1;
+    public:
+        Symbol intern (StringRef name) {
+            auto inserted = symbols.try_emplace (name, symbols.size ());
+            return Symbol (&*inserted.first);
+        }
 
-        } while ((isdigit (last_char) || last_char == '.') && num_points <= 1);
+        size_t size () const { return symbols.size (); }
+};
 
-        num_val = strtod (number_str.c_str(), nullptr);
-        return TOK_NUMBER;
-    }
+}
 
-    if (last_char == '#') {
-        do { 
-            last_char = getchar ();
-        } while (last_char != EOF && last_char != '\n' && last_char != '\r');
+namespace llvm {
 
-        if (last_char != EOF)
-            return get_token ();
+template <> struct DenseMapInfo<Symbol> {
+    static Symbol getEmptyKey () {
+        return Symbol::get_from_opaque_value (DenseMapInfo<const void *>::getEmptyKey ());
+    }
+    static Symbol getTombstoneKey () {
+        return Symbol::get_from_opaque_value (DenseMapInfo<const void *>::getTombstoneKey ());
     }
-    
-    if (last_char == EOF)
-        return TOK_EOF;
-    
-    int curr_char = last_char;
-    last_char = getchar ();
+    static unsigned getHashValue (Symbol symbol) {
+        return DenseMapInfo<const void *>::getHashValue (symbol.get_opaque_value ());
+    }
+    static bool isEqual (Symbol LHS, Symbol RHS) { return LHS == RHS; }
+};
 
-    return curr_char;
 }
 
-
-//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
-//--------------------------------------------------------------------------------
-// AST
-//--------------------------------------------------------------------------------
-//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
-
 namespace {
 
-class ExprAST {
-    public:
-        virtual ~ExprAST () = default;
-        virtual Value *codegen() = 0;
-};
+// A position in the input as a 32-bit byte offset, which SourceText turns
+// into line:column only when a diagnostic is printed.
+struct SourceLocation {
+    uint32_t offset = UINT32_MAX;
 
-class NumberExprAST: public ExprAST {
-    double num_value;
+    SourceLocation () = default;
+    explicit SourceLocation (uint32_t offset): offset (offset) {}
 
-    public:
-        NumberExprAST (double num): num_value(num) {}
-        Value *codegen() override;
+    explicit operator bool () const { return offset != UINT32_MAX; }
 };
 
-
-class VariableExprAST: public ExprAST {
+// All input the lexer has seen: a whole file, or every REPL line so far
+// appended to one buffer, so locations stay valid for the whole session. The
+// table of line starts is built lazily, up to the furthest location asked
+// about, so lexing never pays for it. Diagnostics may come from compile
+// threads while the REPL appends input, hence the mutex.
+class SourceText {
+    std::unique_ptr<MemoryBuffer> file_buffer;
+    std::string repl_text;
     std::string name;
-    
-    public:
-        VariableExprAST (const std::string& name): name(name) {}
-        Value *codegen() override;
-};
-
+    StringRef text;
 
-class BinaryExprAST: public ExprAST {
-    char op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    mutable std::mutex mutex;
+    mutable std::vector<uint32_t> line_starts = {0};
+    mutable uint32_t num_scanned = 0;
 
     public:
-        BinaryExprAST (char op, std::unique_ptr<ExprAST> LHS, std::unique_ptr<ExprAST> RHS)
-            : op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-        Value *codegen() override;
+        void set_buffer (std::unique_ptr<MemoryBuffer> buffer);
+        void set_interactive ();
 
-};
+        /// Appends a line of REPL input and returns all of the text, which
+        /// may have moved.
+        StringRef append (StringRef line);
 
+        StringRef get_text () const { return text; }
 
-class CallExprAST: public ExprAST {
-    std::string name;
-    std::vector<std::unique_ptr<ExprAST>> args;
+        /// Prints `message` with the file, line and column of `location` and
+        /// the source line it points into; `location` must be valid.
+        void print_error (SourceLocation location, const char *message) const;
+};
 
-    public:
-        CallExprAST (const std::string& callee_name, std::vector<std::unique_ptr<ExprAST>> args)
-            : name (callee_name), args (std::move(args)) {}
-        Value *codegen() override;
+// The lexer walks a cursor over an in-memory span of source text. Files and
+// piped stdin are mapped/slurped whole up front; an interactive stdin is read
+// a line at a time so the REPL keeps working. Either way the span is NUL
+// terminated, so scanning loops need no explicit end check.
+class Lexer {
+    SourceText source;
+    bool interactive_input = false;
+    const char *cur_ptr = "";
+    const char *buf_end = cur_ptr;
+    const char *token_start = cur_ptr;
 
-};
+    SymbolTable symbols;
+    Symbol def_symbol, extern_symbol;
 
+    Symbol identifier;
+    double num_val = 0;
 
-class PrototypeAST {
-    std::string name;
-    std::vector<std::string> args;
+    uint64_t num_tokens = 0;
+
+    bool refill_buffer ();
+    int lex_token ();
 
     public:
-        PrototypeAST (const std::string& name, std::vector<std::string> args)
-            : name (name), args(std::move(args)) {}
-        
-        const std::string &get_name () const { return name; }
-        Function *codegen();
-};
+        Lexer ();
 
+        bool open_source (StringRef filename);
+        void set_source (std::unique_ptr<MemoryBuffer> buffer);
 
-class FunctionAST {
-    std::unique_ptr<PrototypeAST>  prototype;
-    std::unique_ptr<ExprAST>       body;
+        bool is_interactive () const { return interactive_input; }
 
-    public:
-        FunctionAST (std::unique_ptr<PrototypeAST> prototype, std::unique_ptr<ExprAST> body)
-            : prototype (std::move(prototype)), body (std::move(body)) {}
-        Function *codegen();
-};
+        int get_token ();
+        uint64_t get_num_tokens () const { return num_tokens; }
 
+        Symbol get_identifier () const { return identifier; }
+        double get_number () const { return num_val; }
 
-}
+        /// Where the current token starts.
+        SourceLocation get_token_location () const;
 
+        /// Whether only whitespace or a comment follows the current token on
+        /// its line.
+        bool at_line_end () const;
+        const SourceText &get_source () const { return source; }
 
-//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
-//--------------------------------------------------------------------------------
-// PARSER
-//--------------------------------------------------------------------------------
-//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+        SymbolTable &get_symbols () { return symbols; }
+};
 
-static int current_token;
-static std::map<char, int> binary_op_precedence;
-static int get_next_token () { return current_token = get_token (); }
+}
 
-static int get_token_precedence () {
-    if (!isascii (current_token))
-        return -1;
+Lexer::Lexer ()
+    : def_symbol (symbols.intern ("def")), extern_symbol (symbols.intern ("extern")) {}
 
-    int token_precedence = binary_op_precedence[current_token];
-    if (token_precedence <= 0)
-        return -1;
-    
-    return token_precedence;
+void SourceText::set_buffer (std::unique_ptr<MemoryBuffer> buffer) {
+    std::lock_guard<std::mutex> lock (mutex);
+    file_buffer = std::move(buffer);
+    name = file_buffer->getBufferIdentifier ().str ();
+    text = file_buffer->getBuffer ();
+    line_starts.assign (1, 0);
+    num_scanned = 0;
 }
 
-std::unique_ptr<ExprAST> log_error (const char* err_str) {
-    fprintf (stderr, "Error: %s\n", err_str);
-    return nullptr;
+void SourceText::set_interactive () {
+    std::lock_guard<std::mutex> lock (mutex);
+    file_buffer.reset ();
+    repl_text.clear ();
+    name = "<stdin>";
+    text = repl_text;
+    line_starts.assign (1, 0);
+    num_scanned = 0;
 }
 
-std::unique_ptr<PrototypeAST> log_error_p (const char* err_str) {
-    log_error (err_str);
-    return nullptr;
+StringRef SourceText::append (StringRef line) {
+    std::lock_guard<std::mutex> lock (mutex);
+    repl_text.append (line.begin (), line.end ());
+    text = repl_text;
+    return text;
 }
 
-static std::unique_ptr<ExprAST> parse_expression ();
+void SourceText::print_error (SourceLocation location, const char *message) const {
+    std::string diagnostic;
+    raw_string_ostream out (diagnostic);
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        uint32_t offset = std::min<size_t> (location.offset, text.size ());
+
+        // Find the line starts up to `offset` that previous diagnostics have
+        // not found yet.
+        while (num_scanned < offset) {
+            const void *newline = memchr (text.data () + num_scanned, '\n', offset - num_scanned);
+            if (!newline) {
+                num_scanned = offset;
+                break;
+            }
 
-///numberexpr ::= number
-static std::unique_ptr<ExprAST> parse_number_expression () {
-    auto result = std::make_unique<NumberExprAST> (num_val);
-    get_next_token (); // eat number
-    return std::move(result);
+            num_scanned = (const char *) newline - text.data () + 1;
+            line_starts.push_back (num_scanned);
+        }
+
+        auto line_it = std::upper_bound (line_starts.begin (), line_starts.end (), offset);
+        uint32_t line_start = *(line_it - 1);
+        StringRef line = text.slice (line_start, text.find_first_of ("\r\n", line_start));
+        uint32_t column = offset - line_start;
+
+        out << "Error: " << name << ":" << (line_it - line_starts.begin ()) << ":" << column + 1
+            << ": " << message << "\n" << line << "\n";
+
+        // Keep tabs, so the caret lines up however wide the terminal draws them.
+        for (char c : line.take_front (column))
+            out << (c == '\t' ? '\t' : ' ');
+        out << "^\n";
+    }
+
+    // One write, so diagnostics from several threads don't interleave.
+    fputs (out.str ().c_str (), stderr);
 }
 
-///parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> parse_paren_expression () {
-    get_next_token (); // eat (
-    auto expr = parse_expression ();
+bool Lexer::open_source (StringRef filename) {
+    if (filename == "-" && sys::Process::StandardInIsUserInput ()) {
+        interactive_input = true;
+        source.set_interactive ();
+        cur_ptr = buf_end = token_start = source.get_text ().data ();
+        return true;
+    }
 
-    if (!expr)
-        return nullptr;
+    auto buffer_or_err = MemoryBuffer::getFileOrSTDIN (filename);
+    if (!buffer_or_err) {
+        fprintf (stderr, "Error: could not open '%s': %s\n",
+                 filename.str().c_str(), buffer_or_err.getError().message().c_str());
+        return false;
+    }
 
-    if (current_token != ')')
-        return log_error ("expected ')'");
+    set_source (std::move(*buffer_or_err));
+    return true;
+}
 
-    get_next_token (); // eat )
+void Lexer::set_source (std::unique_ptr<MemoryBuffer> buffer) {
+    source.set_buffer (std::move(buffer));
+    interactive_input = false;
+    cur_ptr = token_start = source.get_text ().begin ();
+    buf_end = source.get_text ().end ();
+}
 
-    return expr;
+SourceLocation Lexer::get_token_location () const {
+    size_t offset = token_start - source.get_text ().data ();
+    return offset < UINT32_MAX ? SourceLocation (offset) : SourceLocation ();
 }
 
-/// idetifier 
-///     ::= identifier
-///     ::= identifier '(' expression ')'
-static std::unique_ptr<ExprAST> parse_identifier_expression () {
-    std::string identifier_name = identifier_str;
+bool Lexer::at_line_end () const {
+    const char *ptr = cur_ptr;
+    while (ptr != buf_end && *ptr != '\n' && isspace ((unsigned char) *ptr))
+        ++ptr;
 
-    get_next_token (); // eat identifier;
+    return ptr == buf_end || *ptr == '\n' || *ptr == '#';
+}
 
-    if (current_token != '(') // then its simple var ref
-        return std::make_unique<VariableExprAST> (identifier_name);
-    
-    // else it's call
-    get_next_token (); // eat (
-    std::vector<std::unique_ptr<ExprAST>> call_args;
+/// Pulls the next line of REPL input into the lexer's span. Returns false at EOF.
+bool Lexer::refill_buffer () {
+    if (!interactive_input)
+        return false;
 
-    if (current_token != ')') {
-        while (true) {
-            if (auto arg = parse_expression ()) {
-                call_args.push_back (std::move(arg));
-            }
+    char *line = nullptr;
+    size_t capacity = 0;
+    ssize_t length = getline (&line, &capacity, stdin);
 
-            if (current_token == ')')
-                break;
-            
-            if (current_token != ',')
-                return log_error ("expected ')' or ',' ");
-            
-            get_next_token();
-        }
-    }
+    StringRef text;
+    if (length > 0)
+        text = source.append (StringRef (line, length));
+    free (line);
 
-    get_next_token (); // eat )
+    if (length <= 0)
+        return false;
 
-    return std::make_unique<CallExprAST>(identifier_name, std::move(call_args));
+    // Only whitespace was left, so nothing points into the old text.
+    buf_end = text.end ();
+    cur_ptr = token_start = buf_end - length;
+    return true;
 }
 
-/// primary 
-///     ::= identifier
-///     ::= numberexpr 
-///     ::= parenexpr
-static std::unique_ptr<ExprAST> parse_primary() {
-    switch (current_token) {
-        case TOK_IDENTIFIER:
-            return parse_identifier_expression ();
-        case TOK_NUMBER:
-            return parse_number_expression ();
-        case '(':
-            return parse_paren_expression ();
-        default:
-            return log_error ("unknown token");
-    }
+int Lexer::get_token () {
+    // Tokens are far too fine-grained to time one by one; a timer start and
+    // stop costs more than lexing the token.
+    ++num_tokens;
+    return lex_token ();
 }
 
-/// binoprhs
-///     ::= ('+' primary)*
-static std::unique_ptr<ExprAST> parse_bin_op_rhs (int expr_prec, std::unique_ptr<ExprAST> LHS) {
+int Lexer::lex_token () {
+    // Skip any whitespace and comments, pulling in more input when the span
+    // runs dry.
     while (true) {
-        int token_prec = get_token_precedence ();
-
-        if (token_prec < expr_prec)
-            return LHS;
-        
-        int binop = current_token;
-        get_next_token ();  // eat_binop
+        while (isspace ((unsigned char) *cur_ptr))
+            ++cur_ptr;
 
-        auto RHS = parse_primary ();
-        if (!RHS)
-            return nullptr;
-        
-        int next_prec = get_token_precedence ();
-        if (token_prec < next_prec) {
-            RHS = parse_bin_op_rhs (token_prec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr; 
+        if (*cur_ptr == '#') {
+            while (cur_ptr != buf_end && *cur_ptr != '\n' && *cur_ptr != '\r')
+                ++cur_ptr;
+            continue;
         }
 
-        //merge LHS, RHS
-        LHS = std::make_unique<BinaryExprAST>(binop, std::move(LHS), std::move(RHS));
+        if (cur_ptr != buf_end)
+            break;
+
+        if (!refill_buffer ()) {
+            token_start = cur_ptr;
+            return TOK_EOF;
+        }
     }
 
-} 
+    token_start = cur_ptr;
 
-/// expression ::= primary binoprhs
-std::unique_ptr<ExprAST> parse_expression () {
-    auto LHS = parse_primary ();
-    if (!LHS)
-        return nullptr;
-    
-    return parse_bin_op_rhs (0, std::move(LHS));
-}
+    if (isalpha ((unsigned char) *cur_ptr)) {
+        while (isalnum ((unsigned char) *++cur_ptr))
+            ;
 
-/// prototype ::= identifier '(' identifier* ')'
-static std::unique_ptr<PrototypeAST> parse_prototype () {
-    if (current_token != TOK_IDENTIFIER)
-        return log_error_p ("Expected function name in prototype");
+        identifier = symbols.intern (StringRef (token_start, cur_ptr - token_start));
 
-    std::string func_name = identifier_str;
-    get_next_token ();
+        if (identifier == def_symbol)
+            return TOK_DEF;
 
-    if (current_token != '(')
-        return log_error_p ("Expected '(' in prototype");
+        if (identifier == extern_symbol)
+            return TOK_EXTERN;
 
-    std::vector<std::string> arg_names;
-    while (get_next_token () == TOK_IDENTIFIER)
-        arg_names.push_back (identifier_str);
-    
-    if (current_token != ')')
-        return log_error_p ("Expected ')' in prototype");
-    
-    get_next_token (); // eat )
+        return TOK_IDENTIFIER;
+    }
 
-    return std::make_unique<PrototypeAST> (func_name, std::move(arg_names));
-}
 
-/// definition ::= 'def' prototype expression
-static std::unique_ptr<FunctionAST> parse_definition () {
-    get_next_token (); // eat def
-    auto prototype = parse_prototype ();
-    
-    if (!prototype)
-        return nullptr;
-    
-    if (auto expr = parse_expression ())
-        return std::make_unique<FunctionAST> (std::move(prototype), std::move(expr));
+    if (isdigit ((unsigned char) *cur_ptr) || *cur_ptr == '.') {
+        int num_points = 0;
 
-    return nullptr;
-    
-}
+        do {
+            ++cur_ptr;
 
-/// toplevelexpr ::= expression
-std::unique_ptr<FunctionAST> parse_toplevel_expression () {
-    if (auto expression = parse_expression ()) {    
-        auto prototype = std::make_unique<PrototypeAST>("__anon_expr", std::vector<std::string>()); 
-        return std::make_unique<FunctionAST> (std::move(prototype), std::move(expression));
-    }
+            if (*cur_ptr == '.')
+                num_points += 1;
 
-    return nullptr;
-}
+        } while ((isdigit ((unsigned char) *cur_ptr) || *cur_ptr == '.') && num_points <= 1);
 
-/// extern ::= 'extern' prototype
-std::unique_ptr<PrototypeAST> parse_extern () {
-    get_next_token (); // eat 'extern'
-    return parse_prototype ();
+        SmallString<32> number_str (token_start, cur_ptr);
+        num_val = strtod (number_str.c_str(), nullptr);
+        return TOK_NUMBER;
+    }
+
+    return (unsigned char) *cur_ptr++;
 }
 
 
 //flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
 //--------------------------------------------------------------------------------
-// CODE GENERATION
+// AST
 //--------------------------------------------------------------------------------
 //flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
 
-static std::unique_ptr<LLVMContext> the_context;
-static std::unique_ptr<Module> the_module;
-static std::unique_ptr<IRBuilder<>> builder;
-static std::map<std::string, Value *> named_values;
+namespace {
 
-Value *log_error_v(const char *err_string) {
-  log_error(err_string);
-  return nullptr;
-}
+class CodeGenContext;
+class BytecodeCompiler;
+struct BytecodeFunction;
+class PrototypeAST;
 
-Value *NumberExprAST::codegen() {
-    return ConstantFP::get(*the_context, APFloat(num_value));
-}
+using PrototypeMap = DenseMap<Symbol, std::shared_ptr<PrototypeAST>>;
 
-Value *VariableExprAST::codegen() {
-  // Look this variable up in the function.
-  Value *value = named_values[name];
-  
-  if (!value)
-    return log_error_v("Unknown variable name");
-  
-  return value;
-}
+// Bump-pointer storage for every expression node of one top-level item. Nodes
+// (and the names and argument lists they point to) are never destroyed one by
+// one: the whole tree goes away in one shot together with its arena.
+class ASTArena {
+    BumpPtrAllocator allocator;
+    size_t num_nodes = 0;
 
-Value *BinaryExprAST::codegen() {
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
-  if (!L || !R)
-    return nullptr;
+    public:
+        template <typename T, typename... ArgTs>
+        T *make (ArgTs &&...args) {
+            static_assert (std::is_trivially_destructible<T>::value,
+                           "arena-allocated nodes must not need destruction");
+            ++num_nodes;
+            return new (allocator.Allocate<T> ()) T (std::forward<ArgTs>(args)...);
+        }
 
-  switch (op) {
-  case '+':
-    return builder->CreateFAdd(L, R, "addtmp");
-  case '-':
-    return builder->CreateFSub(L, R, "subtmp");
-  case '*':
-    return builder->CreateFMul(L, R, "multmp");
-  case '<':
-    L = builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return builder->CreateUIToFP(L, Type::getDoubleTy(*the_context), "booltmp");
-  default:
-    return log_error_v("invalid binary operator");
-  }
-}
+        template <typename T>
+        ArrayRef<T> copy (ArrayRef<T> items) {
+            T *data = allocator.Allocate<T> (items.size ());
+            std::uninitialized_copy (items.begin (), items.end (), data);
+            return ArrayRef<T> (data, items.size ());
+        }
 
-Value *CallExprAST::codegen() {
-  // Look up the name in the global module table.
-  Function *callee_func = the_module->getFunction(name);
-  if (!callee_func)
-    return log_error_v("Unknown function referenced");
+        size_t size () const { return num_nodes; }
+};
 
-  // If argument mismatch error.
-  if (callee_func->arg_size() != args.size())
-    return log_error_v("Incorrect # arguments passed");
+class ExprAST {
+    protected:
+        // Sits in the padding after the vtable pointer; subclasses start their
+        // fields with 4-byte ones to fill the rest, so binary and call nodes
+        // are no bigger for it. Shared (hash-consed) nodes keep the location
+        // of their first occurrence.
+        SourceLocation location;
 
-  std::vector<Value *> args_vec;
-  for (unsigned i = 0, e = args.size(); i != e; ++i) {
-    args_vec.push_back(args[i]->codegen());
-    if (!args_vec.back())
-      return nullptr;
-  }
+        ExprAST (SourceLocation location): location (location) {}
 
-  return builder->CreateCall(callee_func, args_vec, "calltmp");
-}
+        // Nodes live in an ASTArena and are never deleted through a base pointer.
+        ~ExprAST () = default;
 
-Function *PrototypeAST::codegen() {
-  std::vector<Type *> doubles_vec(args.size(), Type::getDoubleTy(*the_context));
-  FunctionType *func_type 
-        = FunctionType::get(Type::getDoubleTy(*the_context), doubles_vec, false);
+    public:
+        SourceLocation get_location () const { return location; }
 
-  Function *func 
-        = Function::Create(func_type, Function::ExternalLinkage, name, the_module.get());
+        virtual Value *codegen(CodeGenContext &ctx) = 0;
 
-  // Set names for all arguments.
-  unsigned Idx = 0;
-  for (auto &arg : func->args())
-    arg.setName(args[Idx++]);
+        /// Emits bytecode for this node; returns the register holding its value.
+        virtual uint32_t compile_bytecode(BytecodeCompiler &compiler) = 0;
 
-  return func;
-}
+        /// Mixes the structure of this subtree into `hash`. Calls also mix in
+        /// the arity of the callee's current prototype, since a cached body
+        /// is only valid while the call still type-checks.
+        virtual void hash(MD5 &hash, const PrototypeMap &protos) const = 0;
+};
 
-Function *FunctionAST::codegen() {
-  // First, check for an existing function from a previous 'extern' declaration.
-  Function *the_func = the_module->getFunction(prototype->get_name());
+class NumberExprAST: public ExprAST {
+    double num_value;
 
-  if (!the_func)
-    the_func = prototype->codegen();
+    public:
+        NumberExprAST (double num, SourceLocation location)
+            : ExprAST (location), num_value(num) {}
+        Value *codegen(CodeGenContext &ctx) override;
+        uint32_t compile_bytecode(BytecodeCompiler &compiler) override;
+        void hash(MD5 &hash, const PrototypeMap &protos) const override;
+};
 
-  if (!the_func)
-    return nullptr;
 
-  // Create a new basic block to start insertion into.
-  BasicBlock *basic_block = BasicBlock::Create(*the_context, "entry", the_func);
-  builder->SetInsertPoint(basic_block);
+class VariableExprAST: public ExprAST {
+    Symbol name;
 
-  // Record the function arguments in the named_values map.
-  named_values.clear();
-  for (auto &arg : the_func->args())
-    named_values[std::string(arg.getName())] = &arg;
+    public:
+        VariableExprAST (Symbol name, SourceLocation location)
+            : ExprAST (location), name(name) {}
+        Value *codegen(CodeGenContext &ctx) override;
+        uint32_t compile_bytecode(BytecodeCompiler &compiler) override;
+        void hash(MD5 &hash, const PrototypeMap &protos) const override;
+};
 
-  if (Value *ret_val = body->codegen()) {
-    // Finish off the function.
-    builder->CreateRet(ret_val);
 
-    // Validate the generated code, checking for consistency.
-    verifyFunction(*the_func);
+class BinaryExprAST: public ExprAST {
+    char op;
+    ExprAST *LHS, *RHS;
 
-    return the_func;
-  }
+    public:
+        BinaryExprAST (char op, ExprAST *LHS, ExprAST *RHS, SourceLocation location)
+            : ExprAST (location), op(op), LHS(LHS), RHS(RHS) {}
+        Value *codegen(CodeGenContext &ctx) override;
+        uint32_t compile_bytecode(BytecodeCompiler &compiler) override;
+        void hash(MD5 &hash, const PrototypeMap &protos) const override;
 
-  // Error reading body, remove function.
-  the_func->eraseFromParent();
-  return nullptr;
-}
+};
 
 
-//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
-//--------------------------------------------------------------------------------
-// TOP-LEVEL PARSING
-//--------------------------------------------------------------------------------
-//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+class CallExprAST: public ExprAST {
+    uint32_t num_args;
+    Symbol name;
+    ExprAST *const *args;
 
-static void initialize_module() {
-  the_context = std::make_unique<LLVMContext>();
-  the_module = std::make_unique<Module>("my cool jit", *the_context);
+    public:
+        CallExprAST (Symbol callee_name, ArrayRef<ExprAST *> args, SourceLocation location)
+            : ExprAST (location), num_args (args.size ()), name (callee_name), args (args.data ()) {}
 
-  builder = std::make_unique<IRBuilder<>>(*the_context);
-}
+        ArrayRef<ExprAST *> get_args () const { return ArrayRef<ExprAST *> (args, num_args); }
+        Value *codegen(CodeGenContext &ctx) override;
+        uint32_t compile_bytecode(BytecodeCompiler &compiler) override;
+        void hash(MD5 &hash, const PrototypeMap &protos) const override;
 
-static void handle_definition () {
-    if (auto FnAST = parse_definition ()) {
-        fprintf (stderr, "Parsed a func. definition\n");
+};
 
-        if (auto *FnIR = FnAST->codegen()) {
-            FnIR->print(errs());
-            fprintf(stderr, "\n");
+
+static_assert (sizeof (BinaryExprAST) == 32 && sizeof (CallExprAST) == 32,
+               "source locations should not grow the inner AST nodes");
+
+// Reference to a node of a FlatExprAST. Converts from nullptr so the parser
+// can report failure the same way for both AST flavours.
+struct FlatNodeRef {
+    uint32_t index = UINT32_MAX;
+
+    FlatNodeRef () = default;
+    FlatNodeRef (std::nullptr_t) {}
+    explicit FlatNodeRef (uint32_t index): index (index) {}
+
+    explicit operator bool () const { return index != UINT32_MAX; }
+};
+
+// Data-oriented alternative to the ExprAST hierarchy: every node of a body is
+// a fixed-size tagged record in one contiguous vector, linked by 32-bit
+// indices. Identifiers sit in a side table, call arguments in a side list and
+// source locations in a vector parallel to the nodes.
+// The parser appends nodes children-first, so codegen is a single forward
+// sweep with a switch instead of a virtual call per node.
+class FlatExprAST {
+    public:
+        enum NodeKind : uint8_t { NODE_NUMBER, NODE_VARIABLE, NODE_BINARY, NODE_CALL };
+
+        struct BinaryLinks { uint32_t lhs, rhs; };
+        struct CallLinks   { uint32_t first_arg, num_args; };
+
+        struct Node {
+            NodeKind kind;
+            char     op;
+            uint32_t name;      // identifier index for variables and calls
+            union {
+                double      number;
+                BinaryLinks binary;
+                CallLinks   call;
+            };
+        };
+
+    private:
+        std::vector<Node>       nodes;
+        std::vector<SourceLocation> locations;
+        std::vector<uint32_t>   call_args;
+        std::vector<Symbol>     identifiers;
+        DenseMap<Symbol, uint32_t> identifier_ids;
+        FlatNodeRef             root;
+
+        uint32_t get_identifier (Symbol name);
+        FlatNodeRef add (const Node &node, SourceLocation location);
+
+    public:
+        FlatNodeRef add_number (double value, SourceLocation location);
+        FlatNodeRef add_variable (Symbol name, SourceLocation location);
+        FlatNodeRef add_binary (char op, FlatNodeRef LHS, FlatNodeRef RHS, SourceLocation location);
+        FlatNodeRef add_call (Symbol callee_name, ArrayRef<FlatNodeRef> args, SourceLocation location);
+
+        void set_root (FlatNodeRef node) { root = node; }
+        size_t size () const { return nodes.size (); }
+
+        Value *codegen(CodeGenContext &ctx);
+        uint32_t compile_bytecode(BytecodeCompiler &compiler);
+        void hash(MD5 &hash, const PrototypeMap &protos) const;
+};
+
+static_assert (sizeof (FlatExprAST::Node) == 16, "flat AST nodes should stay compact");
+
+
+class PrototypeAST {
+    Symbol name;
+    std::vector<Symbol> args;
+    SourceLocation location;
+
+    public:
+        PrototypeAST (Symbol name, std::vector<Symbol> args, SourceLocation location)
+            : name (name), args(std::move(args)), location (location) {}
+
+        Symbol get_name () const { return name; }
+        SourceLocation get_location () const { return location; }
+        ArrayRef<Symbol> get_args () const { return args; }
+        Function *codegen(CodeGenContext &ctx);
+        void hash(MD5 &hash) const;
+};
+
+
+class FunctionAST {
+    std::shared_ptr<PrototypeAST>  prototype;
+    std::unique_ptr<ASTArena>      arena;
+    ExprAST                        *body = nullptr;
+    std::unique_ptr<FlatExprAST>   flat_body;
+
+    public:
+        FunctionAST (std::unique_ptr<PrototypeAST> prototype, std::unique_ptr<ASTArena> arena,
+                     ExprAST *body)
+            : prototype (std::move(prototype)), arena (std::move(arena)), body (body) {}
+        FunctionAST (std::unique_ptr<PrototypeAST> prototype, std::unique_ptr<FlatExprAST> flat_body)
+            : prototype (std::move(prototype)), flat_body (std::move(flat_body)) {}
+
+        /// Shares the prototype with `protos`, making the function callable
+        /// from modules generated afterwards.
+        PrototypeAST &register_prototype(PrototypeMap &protos);
+
+        Symbol get_name() const { return prototype->get_name(); }
+        SourceLocation get_location() const { return prototype->get_location(); }
+        ArrayRef<Symbol> get_args() const { return prototype->get_args(); }
+
+        Function *codegen(CodeGenContext &ctx);
+        Function *codegen_batch(CodeGenContext &ctx);
+        std::unique_ptr<BytecodeFunction> compile_bytecode(BytecodeCompiler &compiler);
+        void hash(MD5 &hash, const PrototypeMap &protos) const;
+};
+
+
+}
+
+template <typename T>
+static void hash_bytes(MD5 &hash, const T &value) {
+  hash.update(ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&value), sizeof(value)));
+}
+
+static void hash_symbol(MD5 &hash, Symbol name) {
+  hash_bytes(hash, name.str().size());
+  hash.update(name.str());
+}
+
+static void hash_callee(MD5 &hash, const PrototypeMap &protos, Symbol name, size_t num_args) {
+  auto proto_it = protos.find(name);
+  uint64_t callee_arity = proto_it == protos.end() ? UINT64_MAX : proto_it->second->get_args().size();
+
+  hash_symbol(hash, name);
+  hash_bytes(hash, (uint64_t)num_args);
+  hash_bytes(hash, callee_arity);
+}
+
+void NumberExprAST::hash(MD5 &hash, const PrototypeMap &) const {
+  hash_bytes(hash, 'n');
+  hash_bytes(hash, num_value);
+}
+
+void VariableExprAST::hash(MD5 &hash, const PrototypeMap &) const {
+  hash_bytes(hash, 'v');
+  hash_symbol(hash, name);
+}
+
+void BinaryExprAST::hash(MD5 &hash, const PrototypeMap &protos) const {
+  hash_bytes(hash, 'b');
+  hash_bytes(hash, op);
+  LHS->hash(hash, protos);
+  RHS->hash(hash, protos);
+}
+
+void CallExprAST::hash(MD5 &hash, const PrototypeMap &protos) const {
+  hash_bytes(hash, 'c');
+  hash_callee(hash, protos, name, num_args);
+  for (ExprAST *arg : get_args())
+    arg->hash(hash, protos);
+}
+
+void FlatExprAST::hash(MD5 &hash, const PrototypeMap &protos) const {
+  // The node vector is a post-order serialization of the tree already.
+  hash_bytes(hash, 'f');
+  for (const Node &node : nodes) {
+    hash_bytes(hash, node.kind);
+    switch (node.kind) {
+    case NODE_NUMBER:
+      hash_bytes(hash, node.number);
+      break;
+    case NODE_VARIABLE:
+      hash_symbol(hash, identifiers[node.name]);
+      break;
+    case NODE_BINARY:
+      hash_bytes(hash, node.op);
+      hash_bytes(hash, node.binary);
+      break;
+    case NODE_CALL:
+      hash_callee(hash, protos, identifiers[node.name], node.call.num_args);
+      for (uint32_t arg = 0; arg != node.call.num_args; ++arg)
+        hash_bytes(hash, call_args[node.call.first_arg + arg]);
+      break;
+    }
+  }
+  hash_bytes(hash, root.index);
+}
+
+void PrototypeAST::hash(MD5 &hash) const {
+  hash_symbol(hash, name);
+  hash_bytes(hash, (uint64_t)args.size());
+  for (Symbol arg : args)
+    hash_symbol(hash, arg);
+}
+
+void FunctionAST::hash(MD5 &hash, const PrototypeMap &protos) const {
+  prototype->hash(hash);
+  if (flat_body)
+    flat_body->hash(hash, protos);
+  else
+    body->hash(hash, protos);
+}
+
+
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+//--------------------------------------------------------------------------------
+// PARSER
+//--------------------------------------------------------------------------------
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+
+namespace {
+
+// Where one compiler's errors go: the input they are located in, how many
+// were reported (by the input loop and compile threads alike) and how many of
+// them are printed before the input loop gives up (0 = no limit).
+class Diagnostics {
+    const SourceText *source;
+    std::atomic<unsigned> error_count {0};
+    std::atomic<unsigned> error_limit {0};
+
+    public:
+        explicit Diagnostics (const SourceText *source = nullptr): source (source) {}
+
+        /// Starts counting errors afresh against a new limit.
+        void reset_errors (unsigned limit) {
+            error_count = 0;
+            error_limit = limit;
+        }
+
+        unsigned get_error_count () const { return error_count; }
+
+        bool error_limit_reached () const {
+            unsigned limit = error_limit;
+            return limit && error_count >= limit;
+        }
+
+        /// Counts an error at `location`, or without a position if it is
+        /// unknown, and prints it while still within the limit.
+        void report_error (SourceLocation location, const char *err_str);
+};
+
+}
+
+void Diagnostics::report_error (SourceLocation location, const char *err_str) {
+    unsigned limit = error_limit;
+    if (++error_count > limit && limit)
+        return;
+
+    if (source && location)
+        source->print_error (location, err_str);
+    else
+        fprintf (stderr, "Error: %s\n", err_str);
+}
+
+/// Reports an error to `diagnostics`, or just prints it without them.
+std::nullptr_t log_error (Diagnostics *diagnostics, SourceLocation location, const char *err_str) {
+    if (diagnostics)
+        diagnostics->report_error (location, err_str);
+    else
+        fprintf (stderr, "Error: %s\n", err_str);
+    return nullptr;
+}
+
+std::nullptr_t log_error (Diagnostics *diagnostics, const char *err_str) {
+    return log_error (diagnostics, SourceLocation (), err_str);
+}
+
+namespace {
+
+// Node factories the expression parser is templated over, one per AST flavour.
+class PointerASTBuilder {
+    ASTArena &arena;
+
+    public:
+        using NodeRef = ExprAST *;
+
+        PointerASTBuilder (ASTArena &arena): arena (arena) {}
+
+        NodeRef number (double value, SourceLocation location) {
+            return arena.make<NumberExprAST> (value, location);
+        }
+
+        NodeRef variable (Symbol name, SourceLocation location) {
+            return arena.make<VariableExprAST> (name, location);
+        }
+
+        NodeRef binary (char op, NodeRef LHS, NodeRef RHS, SourceLocation location) {
+            return arena.make<BinaryExprAST> (op, LHS, RHS, location);
+        }
+
+        NodeRef call (Symbol callee_name, ArrayRef<NodeRef> args, SourceLocation location) {
+            return arena.make<CallExprAST> (callee_name, arena.copy (args), location);
+        }
+};
+
+class FlatASTBuilder {
+    FlatExprAST &tree;
+
+    public:
+        using NodeRef = FlatNodeRef;
+
+        FlatASTBuilder (FlatExprAST &tree): tree (tree) {}
+
+        NodeRef number (double value, SourceLocation location) {
+            return tree.add_number (value, location);
+        }
+
+        NodeRef variable (Symbol name, SourceLocation location) {
+            return tree.add_variable (name, location);
+        }
+
+        NodeRef binary (char op, NodeRef LHS, NodeRef RHS, SourceLocation location) {
+            return tree.add_binary (op, LHS, RHS, location);
+        }
+
+        NodeRef call (Symbol callee_name, ArrayRef<NodeRef> args, SourceLocation location) {
+            return tree.add_call (callee_name, args, location);
+        }
+};
+
+static uint64_t node_identity (ExprAST *node) { return (uintptr_t) node; }
+static uint64_t node_identity (FlatNodeRef node) { return node.index; }
+
+// Hash-conses the nodes of either builder above: structurally equal literals,
+// variables and binary operators within one body come back as the same node,
+// so repeated subexpressions are stored (and, with codegen memoizing per
+// node, emitted) once. Calls are never merged, since an extern may have side
+// effects.
+template <typename Builder>
+class HashConsingASTBuilder {
+    enum Kind : uint8_t { NUMBER, VARIABLE, BINARY };
+    using Key = std::tuple<uint8_t, char, uint64_t, uint64_t>;
+
+    // DenseMapInfo<uint64_t> keeps only the low bits of a literal's bit
+    // pattern, which are zero for most short decimals; hash_value mixes all.
+    struct KeyInfo: DenseMapInfo<Key> {
+        static unsigned getHashValue (const Key &key) { return hash_value (key); }
+    };
+
+    Builder &base;
+    DenseMap<Key, typename Builder::NodeRef, KeyInfo> nodes;
+
+    public:
+        using NodeRef = typename Builder::NodeRef;
+
+        explicit HashConsingASTBuilder (Builder &base): base (base) {}
+
+        NodeRef number (double value, SourceLocation location) {
+            // Keyed by bit pattern, so 0.0 and -0.0 stay distinct.
+            auto &node = nodes[Key (NUMBER, 0, bit_cast<uint64_t> (value), 0)];
+            if (!node)
+                node = base.number (value, location);
+            return node;
+        }
+
+        NodeRef variable (Symbol name, SourceLocation location) {
+            auto &node = nodes[Key (VARIABLE, 0, name.id (), 0)];
+            if (!node)
+                node = base.variable (name, location);
+            return node;
+        }
+
+        NodeRef binary (char op, NodeRef LHS, NodeRef RHS, SourceLocation location) {
+            auto &node = nodes[Key (BINARY, op, node_identity (LHS), node_identity (RHS))];
+            if (!node)
+                node = base.binary (op, LHS, RHS, location);
+            return node;
+        }
+
+        NodeRef call (Symbol callee_name, ArrayRef<NodeRef> args, SourceLocation location) {
+            return base.call (callee_name, args, location);
+        }
+};
+
+// Sits between the parser and either builder above and simplifies each node
+// as it is built: literal subtrees are folded, x*2 becomes x+x, and with
+// fast-math x*1 and x+0 collapse to x. Literals are only handed to the
+// underlying builder once something uses them, so folded-away constants never
+// reach the AST.
+template <typename Builder>
+class SimplifyingASTBuilder {
+    Builder &base;
+    bool fast_math;
+
+    public:
+        class NodeRef {
+            friend class SimplifyingASTBuilder;
+
+            enum Kind : uint8_t { INVALID, CONSTANT, VARIABLE, EXPRESSION };
+
+            typename Builder::NodeRef node = nullptr;
+            double value = 0;
+            Kind kind = INVALID;
+            SourceLocation location;    // of a constant not yet handed to the base
+
+            NodeRef (Kind kind, typename Builder::NodeRef node, double value = 0,
+                     SourceLocation location = SourceLocation ())
+                : node (node), value (value), kind (kind), location (location) {}
+
+            public:
+                NodeRef () = default;
+                NodeRef (std::nullptr_t) {}
+
+                explicit operator bool () const { return kind != INVALID; }
+        };
+
+    private:
+        static bool is_constant (const NodeRef &node, double value) {
+            return node.kind == NodeRef::CONSTANT && node.value == value;
+        }
+
+        static bool fold (char op, double L, double R, double &result) {
+            switch (op) {
+            case '+': result = L + R; return true;
+            case '-': result = L - R; return true;
+            case '*': result = L * R; return true;
+            case '<':
+                // Matches the unordered compare codegen emits: NaN yields 1.
+                result = (L < R || std::isnan (L) || std::isnan (R)) ? 1.0 : 0.0;
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        typename Builder::NodeRef materialize (NodeRef node) {
+            if (node.kind == NodeRef::CONSTANT && !node.node)
+                node.node = base.number (node.value, node.location);
+            return node.node;
+        }
+
+        NodeRef expression (typename Builder::NodeRef node) {
+            return node ? NodeRef (NodeRef::EXPRESSION, node) : nullptr;
+        }
+
+    public:
+        SimplifyingASTBuilder (Builder &base, bool fast_math): base (base), fast_math (fast_math) {}
+
+        NodeRef number (double value, SourceLocation location) {
+            return NodeRef (NodeRef::CONSTANT, nullptr, value, location);
+        }
+
+        NodeRef variable (Symbol name, SourceLocation location) {
+            return NodeRef (NodeRef::VARIABLE, base.variable (name, location));
+        }
+
+        NodeRef binary (char op, NodeRef LHS, NodeRef RHS, SourceLocation location) {
+            double folded;
+            if (LHS.kind == NodeRef::CONSTANT && RHS.kind == NodeRef::CONSTANT
+                && fold (op, LHS.value, RHS.value, folded))
+                return number (folded, location);
+
+            switch (op) {
+            case '*':
+                if (fast_math && is_constant (RHS, 1))
+                    return LHS;
+                if (fast_math && is_constant (LHS, 1))
+                    return RHS;
+
+                // The operand becomes a shared node, which codegen emits once.
+                if (is_constant (RHS, 2) && LHS.kind != NodeRef::CONSTANT)
+                    return expression (base.binary ('+', LHS.node, LHS.node, location));
+                if (is_constant (LHS, 2) && RHS.kind != NodeRef::CONSTANT)
+                    return expression (base.binary ('+', RHS.node, RHS.node, location));
+                break;
+            case '+':
+                // -0 + 0 is +0, so dropping the zero is only valid with fast-math.
+                if (fast_math && is_constant (RHS, 0))
+                    return LHS;
+                if (fast_math && is_constant (LHS, 0))
+                    return RHS;
+                break;
+            case '-':
+                if (is_constant (RHS, 0) && !std::signbit (RHS.value))
+                    return LHS;
+                break;
+            }
+
+            return expression (base.binary (op, materialize (LHS), materialize (RHS), location));
+        }
+
+        NodeRef call (Symbol callee_name, ArrayRef<NodeRef> args, SourceLocation location) {
+            SmallVector<typename Builder::NodeRef, 8> base_args;
+            for (const NodeRef &arg : args)
+                base_args.push_back (materialize (arg));
+
+            return expression (base.call (callee_name, base_args, location));
+        }
+
+        /// Hands the root of a finished expression to the underlying builder.
+        typename Builder::NodeRef finish (NodeRef root) { return materialize (root); }
+};
+
+enum class Associativity : uint8_t { Left, Right };
+
+class Parser {
+    Lexer &lexer;
+    int current_token = 0;
+    bool flat_ast = false;
+    bool fast_math = false;
+    Symbol anon_expr_symbol;
+
+    PhaseTimers *timers = nullptr;
+    Diagnostics *diagnostics = nullptr;
+    uint64_t num_ast_nodes = 0;
+
+    // Indexed directly by the operator's token value; -1 marks characters that
+    // are not binary operators, so a precedence check is a single load.
+    int8_t binary_op_precedence[256];
+    Associativity binary_op_associativity[256];
+
+    int get_token_precedence ();
+
+    // Syntax errors point at the current token.
+    std::nullptr_t log_error (const char *err_str) {
+        return ::log_error (diagnostics, lexer.get_token_location (), err_str);
+    }
+
+    std::unique_ptr<PrototypeAST> log_error_p (const char *err_str) { return log_error (err_str); }
+
+    template <typename Builder> typename Builder::NodeRef parse_number_expression (Builder &builder);
+    template <typename Builder> typename Builder::NodeRef parse_paren_expression (Builder &builder);
+    template <typename Builder> typename Builder::NodeRef parse_identifier_expression (Builder &builder);
+    template <typename Builder> typename Builder::NodeRef parse_primary (Builder &builder);
+    template <typename Builder>
+    typename Builder::NodeRef parse_bin_op_rhs (Builder &builder, int expr_prec,
+                                                typename Builder::NodeRef LHS);
+    std::unique_ptr<PrototypeAST> parse_prototype ();
+    std::unique_ptr<FunctionAST> parse_function_body (std::unique_ptr<PrototypeAST> prototype);
+
+    public:
+        Parser (Lexer &lexer);
+
+        int get_current_token () const { return current_token; }
+        int get_next_token () { return current_token = lexer.get_token (); }
+
+        /// Recovers from a syntax error by skipping to the next `;`, `def` or
+        /// `extern`, where a new top-level item can start. In the REPL the end
+        /// of the line counts as well.
+        void synchronize ();
+
+        /// Selects the AST flavour function bodies are parsed into.
+        void set_flat_ast (bool enable) { flat_ast = enable; }
+
+        /// Lets the AST simplifier drop +0 and *1, which ignores signed zeros.
+        void set_fast_math (bool enable) { fast_math = enable; }
+
+        void set_timers (PhaseTimers *phase_timers) { timers = phase_timers; }
+
+        /// Where syntax errors are reported; without any they are only printed.
+        void set_diagnostics (Diagnostics *parser_diagnostics) { diagnostics = parser_diagnostics; }
+
+        /// Expression nodes built so far, after simplification and hash consing.
+        uint64_t get_num_ast_nodes () const { return num_ast_nodes; }
+
+        /// Makes `op` a binary operator binding with `precedence` (1..127,
+        /// higher binds tighter), or updates an existing one.
+        void register_binary_op (unsigned char op, int precedence,
+                                 Associativity associativity = Associativity::Left);
+
+        template <typename Builder> typename Builder::NodeRef parse_expression (Builder &builder);
+        std::unique_ptr<FunctionAST> parse_definition ();
+        std::unique_ptr<FunctionAST> parse_toplevel_expression ();
+        std::unique_ptr<PrototypeAST> parse_extern ();
+};
+
+}
+
+Parser::Parser (Lexer &lexer)
+    : lexer (lexer), anon_expr_symbol (lexer.get_symbols ().intern ("__anon_expr")) {
+    std::fill (std::begin (binary_op_precedence), std::end (binary_op_precedence), -1);
+    std::fill (std::begin (binary_op_associativity), std::end (binary_op_associativity),
+               Associativity::Left);
+
+    register_binary_op ('<', 10);
+    register_binary_op ('+', 20);
+    register_binary_op ('-', 20);
+    register_binary_op ('*', 40);
+}
+
+void Parser::register_binary_op (unsigned char op, int precedence, Associativity associativity) {
+    assert (precedence > 0 && precedence <= INT8_MAX && "operator precedence out of range");
+
+    binary_op_precedence[op] = precedence;
+    binary_op_associativity[op] = associativity;
+}
+
+void Parser::synchronize () {
+    while (current_token != ';' && current_token != TOK_DEF && current_token != TOK_EXTERN
+           && current_token != TOK_EOF) {
+        // Reading on would wait for the next line and throw it away, so act
+        // as if this one ended with a `;`.
+        if (lexer.is_interactive () && lexer.at_line_end ()) {
+            current_token = ';';
+            return;
+        }
+
+        get_next_token ();
+    }
+}
+
+int Parser::get_token_precedence () {
+    // Keywords, identifiers, numbers and EOF are negative and never operators.
+    if ((unsigned) current_token > UINT8_MAX)
+        return -1;
+
+    return binary_op_precedence[current_token];
+}
+
+///numberexpr ::= number
+template <typename Builder>
+typename Builder::NodeRef Parser::parse_number_expression (Builder &builder) {
+    auto result = builder.number (lexer.get_number (), lexer.get_token_location ());
+    get_next_token (); // eat number
+    return result;
+}
+
+///parenexpr ::= '(' expression ')'
+template <typename Builder>
+typename Builder::NodeRef Parser::parse_paren_expression (Builder &builder) {
+    get_next_token (); // eat (
+    auto expr = parse_expression (builder);
+
+    if (!expr)
+        return nullptr;
+
+    if (current_token != ')')
+        return log_error ("expected ')'");
+
+    get_next_token (); // eat )
+
+    return expr;
+}
+
+/// idetifier
+///     ::= identifier
+///     ::= identifier '(' expression ')'
+template <typename Builder>
+typename Builder::NodeRef Parser::parse_identifier_expression (Builder &builder) {
+    Symbol identifier_name = lexer.get_identifier ();
+    SourceLocation location = lexer.get_token_location ();
+
+    get_next_token (); // eat identifier;
+
+    if (current_token != '(') // then its simple var ref
+        return builder.variable (identifier_name, location);
+
+    // else it's call
+    get_next_token (); // eat (
+    SmallVector<typename Builder::NodeRef, 8> call_args;
+
+    if (current_token != ')') {
+        while (true) {
+            if (auto arg = parse_expression (builder)) {
+                call_args.push_back (arg);
+            }
+
+            if (current_token == ')')
+                break;
+
+            if (current_token != ',')
+                return log_error ("expected ')' or ',' ");
+
+            get_next_token();
+        }
+    }
+
+    get_next_token (); // eat )
+
+    return builder.call (identifier_name, call_args, location);
+}
+
+/// primary
+///     ::= identifier
+///     ::= numberexpr
+///     ::= parenexpr
+template <typename Builder>
+typename Builder::NodeRef Parser::parse_primary (Builder &builder) {
+    switch (current_token) {
+        case TOK_IDENTIFIER:
+            return parse_identifier_expression (builder);
+        case TOK_NUMBER:
+            return parse_number_expression (builder);
+        case '(':
+            return parse_paren_expression (builder);
+        default:
+            return log_error ("unknown token");
+    }
+}
+
+/// binoprhs
+///     ::= ('+' primary)*
+template <typename Builder>
+typename Builder::NodeRef Parser::parse_bin_op_rhs (Builder &builder, int expr_prec,
+                                                    typename Builder::NodeRef LHS) {
+    while (true) {
+        int token_prec = get_token_precedence ();
+
+        if (token_prec < expr_prec)
+            return LHS;
+
+        int binop = current_token;
+        SourceLocation location = lexer.get_token_location ();
+        get_next_token ();  // eat_binop
+
+        auto RHS = parse_primary (builder);
+        if (!RHS)
+            return nullptr;
+
+        // Let a tighter operator (or another right-associative one at the same
+        // level) take RHS as its LHS first.
+        bool right_assoc = binary_op_associativity[binop] == Associativity::Right;
+
+        int next_prec = get_token_precedence ();
+        if (token_prec < next_prec || (right_assoc && token_prec == next_prec)) {
+            RHS = parse_bin_op_rhs (builder, right_assoc ? token_prec : token_prec + 1, RHS);
+            if (!RHS)
+                return nullptr;
+        }
+
+        //merge LHS, RHS
+        LHS = builder.binary (binop, LHS, RHS, location);
+    }
+
+}
+
+/// expression ::= primary binoprhs
+template <typename Builder>
+typename Builder::NodeRef Parser::parse_expression (Builder &builder) {
+    auto LHS = parse_primary (builder);
+    if (!LHS)
+        return nullptr;
+
+    return parse_bin_op_rhs (builder, 0, LHS);
+}
+
+/// prototype ::= identifier '(' identifier* ')'
+std::unique_ptr<PrototypeAST> Parser::parse_prototype () {
+    if (current_token != TOK_IDENTIFIER)
+        return log_error_p ("Expected function name in prototype");
+
+    Symbol func_name = lexer.get_identifier ();
+    SourceLocation location = lexer.get_token_location ();
+    get_next_token ();
+
+    if (current_token != '(')
+        return log_error_p ("Expected '(' in prototype");
+
+    std::vector<Symbol> arg_names;
+    while (get_next_token () == TOK_IDENTIFIER)
+        arg_names.push_back (lexer.get_identifier ());
+
+    if (current_token != ')')
+        return log_error_p ("Expected ')' in prototype");
+
+    get_next_token (); // eat )
+
+    return std::make_unique<PrototypeAST> (func_name, std::move(arg_names), location);
+}
+
+/// Parses the expression forming a function body into whichever AST flavour
+/// is selected and pairs it with its prototype.
+std::unique_ptr<FunctionAST> Parser::parse_function_body (std::unique_ptr<PrototypeAST> prototype) {
+    if (flat_ast) {
+        auto body = std::make_unique<FlatExprAST> ();
+        FlatASTBuilder flat_builder (*body);
+        HashConsingASTBuilder<FlatASTBuilder> consing_builder (flat_builder);
+        SimplifyingASTBuilder<HashConsingASTBuilder<FlatASTBuilder>> builder (consing_builder, fast_math);
+
+        auto root = parse_expression (builder);
+        if (!root)
+            return nullptr;
+
+        body->set_root (builder.finish (root));
+        num_ast_nodes += body->size ();
+        return std::make_unique<FunctionAST> (std::move(prototype), std::move(body));
+    }
+
+    auto arena = std::make_unique<ASTArena> ();
+    PointerASTBuilder pointer_builder (*arena);
+    HashConsingASTBuilder<PointerASTBuilder> consing_builder (pointer_builder);
+    SimplifyingASTBuilder<HashConsingASTBuilder<PointerASTBuilder>> builder (consing_builder, fast_math);
+
+    auto root = parse_expression (builder);
+    if (!root)
+        return nullptr;
+
+    ExprAST *body = builder.finish (root);
+    num_ast_nodes += arena->size ();
+    return std::make_unique<FunctionAST> (std::move(prototype), std::move(arena), body);
+}
+
+/// definition ::= 'def' prototype expression
+std::unique_ptr<FunctionAST> Parser::parse_definition () {
+    TimeRegion region (phase_timer (timers, &PhaseTimers::parse));
+    TimeTraceScope trace ("Parse");
+
+    get_next_token (); // eat def
+    auto prototype = parse_prototype ();
+
+    if (!prototype)
+        return nullptr;
+
+    return parse_function_body (std::move(prototype));
+}
+
+/// toplevelexpr ::= expression
+std::unique_ptr<FunctionAST> Parser::parse_toplevel_expression () {
+    TimeRegion region (phase_timer (timers, &PhaseTimers::parse));
+    TimeTraceScope trace ("Parse");
+
+    auto prototype = std::make_unique<PrototypeAST>(anon_expr_symbol, std::vector<Symbol>(),
+                                                    lexer.get_token_location ());
+    return parse_function_body (std::move(prototype));
+}
+
+/// extern ::= 'extern' prototype
+std::unique_ptr<PrototypeAST> Parser::parse_extern () {
+    get_next_token (); // eat 'extern'
+    return parse_prototype ();
+}
+
+
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+//--------------------------------------------------------------------------------
+// CODE GENERATION
+//--------------------------------------------------------------------------------
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+
+namespace {
+
+// Name bindings indexed directly by Symbol id, so resolving a variable is one
+// bounds-checked load and never allocates. Entering a scope records where the
+// undo log stands; bindings shadowed inside it are restored on exit, which is
+// all nested scopes need.
+template <typename T>
+class ScopedSymbolTable {
+    std::vector<T> bindings;
+    SmallVector<std::pair<Symbol, T>, 8> shadowed;
+    SmallVector<size_t, 4> scopes;
+
+    public:
+        void push_scope () { scopes.push_back (shadowed.size ()); }
+
+        void pop_scope () {
+            for (size_t mark = scopes.pop_back_val (); shadowed.size () > mark; shadowed.pop_back ())
+                bindings[shadowed.back ().first.id ()] = shadowed.back ().second;
+        }
+
+        void bind (Symbol name, T value) {
+            if (name.id () >= bindings.size ())
+                bindings.resize (name.id () + 1);
+
+            shadowed.emplace_back (name, bindings[name.id ()]);
+            bindings[name.id ()] = value;
+        }
+
+        T lookup (Symbol name) const {
+            return name.id () < bindings.size () ? bindings[name.id ()] : T ();
+        }
+};
+
+// Everything needed to emit IR for one module: the LLVM context, module and
+// builder being filled in, the symbols of the function being generated and the
+// per-function optimization pipeline. Prototypes are shared with the owner so
+// later modules can re-declare functions emitted into earlier ones.
+class CodeGenContext {
+    std::unique_ptr<FunctionPassManager> fpm;
+    std::unique_ptr<FunctionPassManager> vectorize_fpm;
+    std::unique_ptr<LoopAnalysisManager> lam;
+    std::unique_ptr<FunctionAnalysisManager> fam;
+    std::unique_ptr<CGSCCAnalysisManager> cgam;
+    std::unique_ptr<ModuleAnalysisManager> mam;
+
+    std::unique_ptr<PassBuilder> pass_builder;
+    TargetMachine *target_machine;
+    OptimizationLevel opt_level;
+
+    // Functions already declared or defined in the current module.
+    DenseMap<Symbol, Function *> module_functions;
+
+    void initialize_pass_pipeline ();
+
+    public:
+        std::unique_ptr<LLVMContext> context;
+        std::unique_ptr<Module> module;
+        std::unique_ptr<IRBuilder<>> builder;
+        ScopedSymbolTable<Value *> named_values;
+        PrototypeMap &function_protos;
+        PhaseTimers *timers = nullptr;
+
+        // Where errors in the ASTs are reported; without any they are only
+        // printed.
+        Diagnostics *diagnostics = nullptr;
+
+        // Value of every ExprAST already emitted in the current body. Hash
+        // consing shares nodes, so each one is generated only once.
+        DenseMap<const ExprAST *, Value *> expr_values;
+
+        CodeGenContext (PrototypeMap &function_protos, TargetMachine *target_machine,
+                        OptimizationLevel opt_level);
+
+        void initialize_module ();
+        orc::ThreadSafeModule take_module ();
+
+        Function *get_function (Symbol name);
+        Function *get_callee (Symbol name, size_t num_args, SourceLocation location);
+        void erase_function (Symbol name);
+        Value *create_binary_op (char op, Value *L, Value *R);
+        Value *codegen_expr (ExprAST *expr);
+        void verify (Function &func);
+        void optimize (Function &func);
+        void vectorize (Function &func);
+        void optimize_module ();
+};
+
+}
+
+CodeGenContext::CodeGenContext (PrototypeMap &function_protos, TargetMachine *target_machine,
+                                OptimizationLevel opt_level)
+    : target_machine (target_machine), opt_level (opt_level), function_protos (function_protos) {
+  initialize_pass_pipeline();
+  initialize_module();
+}
+
+void CodeGenContext::initialize_pass_pipeline() {
+  lam = std::make_unique<LoopAnalysisManager>();
+  fam = std::make_unique<FunctionAnalysisManager>();
+  cgam = std::make_unique<CGSCCAnalysisManager>();
+  mam = std::make_unique<ModuleAnalysisManager>();
+  fpm = std::make_unique<FunctionPassManager>();
+  vectorize_fpm = std::make_unique<FunctionPassManager>();
+
+  // The analysis managers call back into the PassBuilder (e.g. to build the
+  // alias analysis pipeline), so it has to live as long as they do.
+  pass_builder = std::make_unique<PassBuilder>(target_machine);
+  pass_builder->registerModuleAnalyses(*mam);
+  pass_builder->registerCGSCCAnalyses(*cgam);
+  pass_builder->registerFunctionAnalyses(*fam);
+  pass_builder->registerLoopAnalyses(*lam);
+  pass_builder->crossRegisterProxies(*lam, *fam, *cgam, *mam);
+
+  if (opt_level == OptimizationLevel::O0)
+    return;
+
+  if (opt_level == OptimizationLevel::O1) {
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    fpm->addPass(InstCombinePass());
+    // Reassociate expressions.
+    fpm->addPass(ReassociatePass());
+    // Eliminate Common SubExpressions.
+    fpm->addPass(GVNPass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    fpm->addPass(SimplifyCFGPass());
+    return;
+  }
+
+  // -O2 and -O3 get the full function simplification pipeline, which covers
+  // all of the above plus SROA, EarlyCSE, DSE, loop passes and friends.
+  fpm->addPass(pass_builder->buildFunctionSimplificationPipeline(
+      opt_level, ThinOrFullLTOPhase::None));
+
+  // Batch loops are vectorized for the host's vector width, then the
+  // leftovers of the vectorizer are cleaned up.
+  vectorize_fpm->addPass(LoopVectorizePass());
+  vectorize_fpm->addPass(SLPVectorizerPass());
+  vectorize_fpm->addPass(InstCombinePass());
+  vectorize_fpm->addPass(SimplifyCFGPass());
+}
+
+void CodeGenContext::initialize_module() {
+  context = std::make_unique<LLVMContext>();
+  module = std::make_unique<Module>("my cool jit", *context);
+  module->setDataLayout(target_machine->createDataLayout());
+  module->setTargetTriple(target_machine->getTargetTriple().str());
+
+  builder = std::make_unique<IRBuilder<>>(*context);
+  module_functions.clear();
+}
+
+orc::ThreadSafeModule CodeGenContext::take_module() {
+  auto TSM = orc::ThreadSafeModule(std::move(module), std::move(context));
+  initialize_module();
+  return TSM;
+}
+
+Function *CodeGenContext::get_function(Symbol name) {
+  // First, see if the function has already been added to the current module.
+  auto &func = module_functions[name];
+  if (func)
+    return func;
+
+  // If not, check whether we can codegen the declaration from some existing
+  // prototype: every def lives in its own JIT'd module.
+  auto proto_it = function_protos.find(name);
+  if (proto_it != function_protos.end())
+    func = proto_it->second->codegen(*this);
+
+  return func;
+}
+
+void CodeGenContext::erase_function(Symbol name) {
+  if (Function *func = module_functions.lookup(name)) {
+    func->eraseFromParent();
+    module_functions.erase(name);
+  }
+}
+
+void CodeGenContext::verify(Function &func) {
+  TimeRegion region(phase_timer(timers, &PhaseTimers::verify));
+  TimeTraceScope trace("Verify", func.getName());
+
+  verifyFunction(func);
+}
+
+void CodeGenContext::optimize(Function &func) {
+  TimeRegion region(phase_timer(timers, &PhaseTimers::optimize));
+  TimeTraceScope trace("Optimize", func.getName());
+
+  // Cached analyses are keyed by IR pointers that die with the module, so drop
+  // them once the pipeline is done.
+  fpm->run(func, *fam);
+  fam->clear();
+  mam->clear();
+}
+
+void CodeGenContext::vectorize(Function &func) {
+  TimeRegion region(phase_timer(timers, &PhaseTimers::optimize));
+  TimeTraceScope trace("Vectorize", func.getName());
+
+  vectorize_fpm->run(func, *fam);
+  fam->clear();
+  mam->clear();
+}
+
+void CodeGenContext::optimize_module() {
+  TimeRegion region(phase_timer(timers, &PhaseTimers::optimize));
+  TimeTraceScope trace("OptimizeModule");
+
+  // Every function already went through the function pipeline; the module
+  // pipeline adds the interprocedural work (inlining, global DCE, ...).
+  ModulePassManager mpm =
+      opt_level == OptimizationLevel::O0
+          ? pass_builder->buildO0DefaultPipeline(opt_level)
+          : pass_builder->buildPerModuleDefaultPipeline(opt_level);
+
+  mpm.run(*module, *mam);
+  lam->clear();
+  fam->clear();
+  cgam->clear();
+  mam->clear();
+}
+
+Value *log_error_v(Diagnostics *diagnostics, const char *err_string) {
+  log_error(diagnostics, err_string);
+  return nullptr;
+}
+
+Value *log_error_v(Diagnostics *diagnostics, SourceLocation location, const char *err_string) {
+  log_error(diagnostics, location, err_string);
+  return nullptr;
+}
+
+Function *CodeGenContext::get_callee(Symbol name, size_t num_args, SourceLocation location) {
+  // Look up the name in the global module table.
+  Function *callee_func = get_function(name);
+  if (!callee_func) {
+    log_error(diagnostics, location, "Unknown function referenced");
+    return nullptr;
+  }
+
+  // If argument mismatch error.
+  if (callee_func->arg_size() != num_args) {
+    log_error(diagnostics, location, "Incorrect # arguments passed");
+    return nullptr;
+  }
+
+  return callee_func;
+}
+
+Value *CodeGenContext::create_binary_op(char op, Value *L, Value *R) {
+  switch (op) {
+  case '+':
+    return builder->CreateFAdd(L, R, "addtmp");
+  case '-':
+    return builder->CreateFSub(L, R, "subtmp");
+  case '*':
+    return builder->CreateFMul(L, R, "multmp");
+  case '<':
+    L = builder->CreateFCmpULT(L, R, "cmptmp");
+    // Convert bool 0/1 to double 0.0 or 1.0
+    return builder->CreateUIToFP(L, Type::getDoubleTy(*context), "booltmp");
+  default:
+    return log_error_v(diagnostics, "invalid binary operator");
+  }
+}
+
+Value *CodeGenContext::codegen_expr(ExprAST *expr) {
+  if (Value *value = expr_values.lookup(expr))
+    return value;
+
+  Value *value = expr->codegen(*this);
+  if (value)
+    expr_values[expr] = value;
+  return value;
+}
+
+Value *NumberExprAST::codegen(CodeGenContext &ctx) {
+    return ConstantFP::get(*ctx.context, APFloat(num_value));
+}
+
+Value *VariableExprAST::codegen(CodeGenContext &ctx) {
+  // Look this variable up in the function.
+  Value *value = ctx.named_values.lookup(name);
+
+  if (!value)
+    return log_error_v(ctx.diagnostics, location, "Unknown variable name");
+
+  return value;
+}
+
+Value *BinaryExprAST::codegen(CodeGenContext &ctx) {
+  Value *L = ctx.codegen_expr(LHS);
+  Value *R = ctx.codegen_expr(RHS);
+  if (!L || !R)
+    return nullptr;
+
+  return ctx.create_binary_op(op, L, R);
+}
+
+Value *CallExprAST::codegen(CodeGenContext &ctx) {
+  Function *callee_func = ctx.get_callee(name, num_args, location);
+  if (!callee_func)
+    return nullptr;
+
+  std::vector<Value *> args_vec;
+  for (unsigned i = 0, e = num_args; i != e; ++i) {
+    args_vec.push_back(ctx.codegen_expr(args[i]));
+    if (!args_vec.back())
+      return nullptr;
+  }
+
+  return ctx.builder->CreateCall(callee_func, args_vec, "calltmp");
+}
+
+uint32_t FlatExprAST::get_identifier(Symbol name) {
+  auto inserted = identifier_ids.try_emplace(name, identifiers.size());
+  if (inserted.second)
+    identifiers.push_back(name);
+  return inserted.first->second;
+}
+
+FlatNodeRef FlatExprAST::add(const Node &node, SourceLocation location) {
+  nodes.push_back(node);
+  locations.push_back(location);
+  return FlatNodeRef(nodes.size() - 1);
+}
+
+FlatNodeRef FlatExprAST::add_number(double value, SourceLocation location) {
+  Node node = {};
+  node.kind = NODE_NUMBER;
+  node.number = value;
+  return add(node, location);
+}
+
+FlatNodeRef FlatExprAST::add_variable(Symbol name, SourceLocation location) {
+  Node node = {};
+  node.kind = NODE_VARIABLE;
+  node.name = get_identifier(name);
+  return add(node, location);
+}
+
+FlatNodeRef FlatExprAST::add_binary(char op, FlatNodeRef LHS, FlatNodeRef RHS,
+                                    SourceLocation location) {
+  Node node = {};
+  node.kind = NODE_BINARY;
+  node.op = op;
+  node.binary = {LHS.index, RHS.index};
+  return add(node, location);
+}
+
+FlatNodeRef FlatExprAST::add_call(Symbol callee_name, ArrayRef<FlatNodeRef> args,
+                                  SourceLocation location) {
+  Node node = {};
+  node.kind = NODE_CALL;
+  node.name = get_identifier(callee_name);
+  node.call = {(uint32_t)call_args.size(), (uint32_t)args.size()};
+
+  for (FlatNodeRef arg : args)
+    call_args.push_back(arg.index);
+
+  return add(node, location);
+}
+
+Value *FlatExprAST::codegen(CodeGenContext &ctx) {
+  // Operands always precede their users in the node vector, so a single
+  // forward sweep emits the same instruction sequence as the recursive
+  // ExprAST::codegen walk.
+  std::vector<Value *> values(nodes.size());
+  SmallVector<Value *, 8> args_vec;
+
+  for (size_t i = 0, e = nodes.size(); i != e; ++i) {
+    const Node &node = nodes[i];
+    Value *value = nullptr;
+
+    switch (node.kind) {
+    case NODE_NUMBER:
+      value = ConstantFP::get(*ctx.context, APFloat(node.number));
+      break;
+    case NODE_VARIABLE:
+      value = ctx.named_values.lookup(identifiers[node.name]);
+      if (!value)
+        return log_error_v(ctx.diagnostics, locations[i], "Unknown variable name");
+      break;
+    case NODE_BINARY:
+      value = ctx.create_binary_op(node.op, values[node.binary.lhs],
+                                   values[node.binary.rhs]);
+      break;
+    case NODE_CALL: {
+      Function *callee_func =
+          ctx.get_callee(identifiers[node.name], node.call.num_args, locations[i]);
+      if (!callee_func)
+        return nullptr;
+
+      args_vec.clear();
+      for (uint32_t arg = 0; arg != node.call.num_args; ++arg)
+        args_vec.push_back(values[call_args[node.call.first_arg + arg]]);
+
+      value = ctx.builder->CreateCall(callee_func, args_vec, "calltmp");
+      break;
+    }
+    }
+
+    if (!value)
+      return nullptr;
+    values[i] = value;
+  }
+
+  return values[root.index];
+}
+
+Function *PrototypeAST::codegen(CodeGenContext &ctx) {
+  std::vector<Type *> doubles_vec(args.size(), Type::getDoubleTy(*ctx.context));
+  FunctionType *func_type
+        = FunctionType::get(Type::getDoubleTy(*ctx.context), doubles_vec, false);
+
+  Function *func
+        = Function::Create(func_type, Function::ExternalLinkage, name.str(), ctx.module.get());
+
+  // Set names for all arguments.
+  unsigned Idx = 0;
+  for (auto &arg : func->args())
+    arg.setName(args[Idx++].str());
+
+  return func;
+}
+
+PrototypeAST &FunctionAST::register_prototype(PrototypeMap &protos) {
+  // The function keeps its own reference, so a lazily compiled body can be
+  // generated long after the prototype was published.
+  protos[prototype->get_name()] = prototype;
+  return *prototype;
+}
+
+Function *FunctionAST::codegen(CodeGenContext &ctx) {
+  // Restored if the body fails, so later code can't call a function that
+  // never made it into the JIT.
+  auto previous_proto = ctx.function_protos.lookup(get_name());
+
+  // An earlier extern fixed the arity, and calls may already rely on it.
+  size_t num_args = get_args().size();
+  if (previous_proto && previous_proto->get_args().size() != num_args)
+    return (Function*)log_error_v(ctx.diagnostics, get_location(),
+                                  "Function redefined with a different number of arguments");
+
+  auto restore_prototype = [&] {
+    if (previous_proto)
+      ctx.function_protos[get_name()] = std::move(previous_proto);
+    else
+      ctx.function_protos.erase(get_name());
+  };
+
+  auto &proto = register_prototype(ctx.function_protos);
+  Function *the_func = ctx.get_function(proto.get_name());
+
+  if (!the_func)
+    return nullptr;
+
+  if (!the_func->empty()) {
+    restore_prototype();
+    return (Function*)log_error_v(ctx.diagnostics, get_location(), "Function cannot be redefined.");
+  }
+
+  // So can a declaration this module kept from an extern since replaced.
+  if (the_func->arg_size() != num_args) {
+    restore_prototype();
+    return (Function*)log_error_v(ctx.diagnostics, get_location(),
+                                  "Function redefined with a different number of arguments");
+  }
+
+  // Create a new basic block to start insertion into.
+  BasicBlock *basic_block = BasicBlock::Create(*ctx.context, "entry", the_func);
+  ctx.builder->SetInsertPoint(basic_block);
+
+  // Bind the function arguments in a fresh scope.
+  ctx.named_values.push_scope();
+  for (auto &arg : the_func->args())
+    ctx.named_values.bind(proto.get_args()[arg.getArgNo()], &arg);
+
+  Value *ret_val;
+  {
+    TimeRegion region(phase_timer(ctx.timers, &PhaseTimers::codegen));
+    TimeTraceScope trace("Codegen", proto.get_name().str());
+
+    ctx.expr_values.clear();
+    ret_val = flat_body ? flat_body->codegen(ctx) : ctx.codegen_expr(body);
+  }
+  ctx.named_values.pop_scope();
+
+  if (ret_val) {
+    // Finish off the function.
+    ctx.builder->CreateRet(ret_val);
+
+    // Validate the generated code, checking for consistency.
+    ctx.verify(*the_func);
+
+    // Optimize the function.
+    ctx.optimize(*the_func);
+
+    return the_func;
+  }
+
+  // Error reading body, remove function.
+  ctx.erase_function(proto.get_name());
+  restore_prototype();
+  return nullptr;
+}
+
+Function *FunctionAST::codegen_batch(CodeGenContext &ctx) {
+  // void <name>_batch(const double *arg0, ..., double *out, size_t n) runs the
+  // body once per row: out[i] = body(arg0[i], ...). The body is generated
+  // inline rather than as a call, so the loop vectorizer sees all of it.
+  std::string batch_name = prototype->get_name().str().str() + "_batch";
+  if (ctx.module->getFunction(batch_name))
+    return (Function*)log_error_v(ctx.diagnostics, get_location(),
+                                  "Batch entry point clashes with another function");
+
+  ArrayRef<Symbol> args = prototype->get_args();
+  Type *double_ty = Type::getDoubleTy(*ctx.context);
+  Type *column_ty = PointerType::getUnqual(double_ty);
+  Type *size_ty = ctx.module->getDataLayout().getIntPtrType(*ctx.context);
+
+  std::vector<Type *> params(args.size() + 1, column_ty);
+  params.push_back(size_ty);
+  FunctionType *func_type = FunctionType::get(Type::getVoidTy(*ctx.context), params, false);
+
+  Function *batch_func
+        = Function::Create(func_type, Function::ExternalLinkage, batch_name, ctx.module.get());
+
+  // Columns may overlap (e.g. evaluating in place); the vectorizer guards the
+  // vector loop with runtime overlap checks.
+  for (auto &arg : batch_func->args()) {
+    unsigned arg_no = arg.getArgNo();
+    if (arg_no < args.size()) {
+      arg.setName(args[arg_no].str());
+      batch_func->addParamAttr(arg_no, Attribute::NoCapture);
+      batch_func->addParamAttr(arg_no, Attribute::ReadOnly);
+    } else if (arg_no == args.size()) {
+      arg.setName("out");
+      batch_func->addParamAttr(arg_no, Attribute::NoCapture);
+    } else
+      arg.setName("n");
+  }
+
+  Value *out = batch_func->getArg(args.size());
+  Value *count = batch_func->getArg(args.size() + 1);
+
+  BasicBlock *entry_block = BasicBlock::Create(*ctx.context, "entry", batch_func);
+  BasicBlock *loop_block = BasicBlock::Create(*ctx.context, "loop", batch_func);
+  BasicBlock *exit_block = BasicBlock::Create(*ctx.context, "exit", batch_func);
+
+  ctx.builder->SetInsertPoint(entry_block);
+  Value *zero = ConstantInt::get(size_ty, 0);
+  ctx.builder->CreateCondBr(ctx.builder->CreateICmpEQ(count, zero, "empty"),
+                            exit_block, loop_block);
+
+  ctx.builder->SetInsertPoint(loop_block);
+  PHINode *index = ctx.builder->CreatePHI(size_ty, 2, "i");
+  index->addIncoming(zero, entry_block);
+
+  // Bind each argument to the current row of its column.
+  ctx.named_values.push_scope();
+  for (unsigned arg_no = 0; arg_no != args.size(); ++arg_no) {
+    Value *element = ctx.builder->CreateInBoundsGEP(double_ty, batch_func->getArg(arg_no), index);
+    ctx.named_values.bind(args[arg_no], ctx.builder->CreateLoad(double_ty, element, args[arg_no].str()));
+  }
+
+  Value *row_val;
+  {
+    TimeRegion region(phase_timer(ctx.timers, &PhaseTimers::codegen));
+    TimeTraceScope trace("Codegen", batch_name);
+
+    ctx.expr_values.clear();
+    row_val = flat_body ? flat_body->codegen(ctx) : ctx.codegen_expr(body);
+  }
+  ctx.named_values.pop_scope();
+
+  if (!row_val) {
+    batch_func->eraseFromParent();
+    return nullptr;
+  }
+
+  ctx.builder->CreateStore(row_val, ctx.builder->CreateInBoundsGEP(double_ty, out, index));
+
+  Value *next_index = ctx.builder->CreateAdd(index, ConstantInt::get(size_ty, 1), "i.next",
+                                             /*HasNUW=*/true);
+  index->addIncoming(next_index, ctx.builder->GetInsertBlock());
+  ctx.builder->CreateCondBr(ctx.builder->CreateICmpEQ(next_index, count, "done"),
+                            exit_block, loop_block);
+
+  ctx.builder->SetInsertPoint(exit_block);
+  ctx.builder->CreateRetVoid();
+
+  ctx.verify(*batch_func);
+
+  ctx.optimize(*batch_func);
+  ctx.vectorize(*batch_func);
+
+  return batch_func;
+}
+
+
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+//--------------------------------------------------------------------------------
+// BYTECODE INTERPRETER
+//--------------------------------------------------------------------------------
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+
+namespace {
+
+enum Opcode : uint8_t { OP_ADD, OP_SUB, OP_MUL, OP_LESS, OP_CALL, OP_CALL_NATIVE, OP_RET };
+
+// dest = lhs <op> rhs over the registers of the current frame. Calls keep the
+// index of their CallSite in lhs, and OP_RET returns register lhs.
+struct Instruction {
+    Opcode   opcode;
+    uint16_t dest, lhs, rhs;
+};
+
+static_assert (sizeof (Instruction) == 8, "bytecode instructions should stay compact");
+
+// A call bound when its caller is compiled: to the callee's bytecode, or for
+// an extern to the address of the host function. The argument registers are a
+// slice of BytecodeFunction::call_args.
+struct CallSite {
+    Symbol                  name;
+    const BytecodeFunction  *function = nullptr;
+    void                    *native = nullptr;
+    uint32_t                first_arg = 0, num_args = 0;
+};
+
+struct Constant {
+    uint16_t reg;
+    double   value;
+};
+
+// A definition or top-level expression lowered to register bytecode. Each call
+// gets a frame of num_registers doubles: the arguments first, then one
+// register per distinct literal and expression node, so registers are never
+// reused and nothing needs to be spilled. Literals are stored into their
+// registers on entry.
+struct BytecodeFunction {
+    Symbol                   name;
+    uint32_t                 num_args = 0;
+    uint32_t                 num_registers = 0;
+    std::vector<Instruction> code;
+    std::vector<Constant>    constants;
+    std::vector<CallSite>    calls;
+    std::vector<uint16_t>    call_args;
+
+    // Tier-up state, updated while the code is otherwise immutable. Calls are
+    // counted on the interpreter's thread; once the tier-up thread stores the
+    // address of optimized native code, callers jump there instead.
+    mutable uint32_t           num_calls = 0;
+    mutable std::atomic<void *> native {nullptr};
+
+    void print (raw_ostream &out) const;
+};
+
+// The first execution tier: runs bytecode directly, so code that executes
+// only once or twice never pays for LLVM. Frames are carved out of a single
+// preallocated register stack.
+class Interpreter {
+    DenseMap<Symbol, std::unique_ptr<BytecodeFunction>> functions;
+    std::unique_ptr<double[]> stack;
+    double *stack_end;
+    unsigned depth = 0;
+
+    unsigned tier_up_threshold = 0;
+    std::function<void (const BytecodeFunction &)> on_hot_function;
+
+    double execute (const BytecodeFunction &function, double *registers);
+
+    public:
+        Interpreter ();
+
+        const BytecodeFunction *get_function (Symbol name) const;
+        void add_function (std::unique_ptr<BytecodeFunction> function);
+
+        /// Calls `on_hot` for a definition when it has been called `threshold`
+        /// times without native code to run instead.
+        void set_tier_up (unsigned threshold, std::function<void (const BytecodeFunction &)> on_hot) {
+            tier_up_threshold = threshold;
+            on_hot_function = std::move(on_hot);
+        }
+
+        /// Runs a function without arguments, i.e. a top-level expression.
+        double run (const BytecodeFunction &function);
+};
+
+// Lowers one body at a time to bytecode, the way CodeGenContext lowers it to
+// IR. Calls to definitions bind to bytecode the interpreter already has, calls
+// to externs to the host's symbol of the same name.
+class BytecodeCompiler {
+    const Interpreter &interpreter;
+    const PrototypeMap &function_protos;
+
+    std::unique_ptr<BytecodeFunction> function;
+    DenseMap<Symbol, uint32_t> arg_registers;
+    DenseMap<uint64_t, uint32_t> constant_registers;
+
+    // Hash consing shares nodes, so each one is compiled only once.
+    DenseMap<const ExprAST *, uint32_t> expr_registers;
+
+    uint32_t emit (Opcode opcode, uint32_t lhs, uint32_t rhs);
+
+    public:
+        static const uint32_t invalid_register = UINT32_MAX;
+
+        PhaseTimers *timers = nullptr;
+        Diagnostics *diagnostics = nullptr;
+
+        BytecodeCompiler (const Interpreter &interpreter, const PrototypeMap &function_protos)
+            : interpreter (interpreter), function_protos (function_protos) {}
+
+        void begin (const PrototypeAST &proto);
+        std::unique_ptr<BytecodeFunction> finish (uint32_t result);
+
+        uint32_t compile_expr (ExprAST *expr);
+        uint32_t argument (Symbol name, SourceLocation location);
+        uint32_t constant (double value);
+        uint32_t binary (char op, uint32_t lhs, uint32_t rhs);
+        uint32_t call (Symbol callee_name, ArrayRef<uint32_t> args, SourceLocation location);
+};
+
+}
+
+// Externs called from bytecode go through a plain C call, which needs the
+// arity spelled out at compile time.
+static const unsigned max_native_args = 6;
+
+static const size_t interpreter_stack_size = 1 << 20;
+static const unsigned max_call_depth = 10000;
+
+static uint32_t log_error_r (Diagnostics *diagnostics, SourceLocation location, const char *err_str) {
+    log_error (diagnostics, location, err_str);
+    return BytecodeCompiler::invalid_register;
+}
+
+// Kaleidoscope has no conditionals, so any recursion ends up here.
+static void report_interpreter_stack_overflow () {
+    fprintf (stderr, "Error: interpreter stack overflow\n");
+    exit (1);
+}
+
+void BytecodeCompiler::begin (const PrototypeAST &proto) {
+    function = std::make_unique<BytecodeFunction> ();
+    function->name = proto.get_name ();
+    function->num_args = proto.get_args ().size ();
+    function->num_registers = function->num_args;
+
+    arg_registers.clear ();
+    constant_registers.clear ();
+    expr_registers.clear ();
+
+    // Like the IR, a repeated argument name refers to the last one.
+    for (uint32_t arg = 0; arg != function->num_args; ++arg)
+        arg_registers[proto.get_args ()[arg]] = arg;
+}
+
+std::unique_ptr<BytecodeFunction> BytecodeCompiler::finish (uint32_t result) {
+    if (result == invalid_register)
+        return nullptr;
+
+    if (function->num_registers > UINT16_MAX + 1) {
+        log_error (diagnostics, "Function is too large for the interpreter");
+        return nullptr;
+    }
+
+    function->code.push_back ({OP_RET, 0, (uint16_t) result, 0});
+    return std::move(function);
+}
+
+uint32_t BytecodeCompiler::emit (Opcode opcode, uint32_t lhs, uint32_t rhs) {
+    // Register numbers past UINT16_MAX wrap here; finish() rejects the
+    // function before any of them could run.
+    uint32_t dest = function->num_registers++;
+    function->code.push_back ({opcode, (uint16_t) dest, (uint16_t) lhs, (uint16_t) rhs});
+    return dest;
+}
+
+uint32_t BytecodeCompiler::compile_expr (ExprAST *expr) {
+    auto cached = expr_registers.find (expr);
+    if (cached != expr_registers.end ())
+        return cached->second;
+
+    uint32_t reg = expr->compile_bytecode (*this);
+    if (reg != invalid_register)
+        expr_registers[expr] = reg;
+    return reg;
+}
+
+uint32_t BytecodeCompiler::argument (Symbol name, SourceLocation location) {
+    auto arg_it = arg_registers.find (name);
+    if (arg_it == arg_registers.end ())
+        return log_error_r (diagnostics, location, "Unknown variable name");
+
+    return arg_it->second;
+}
+
+uint32_t BytecodeCompiler::constant (double value) {
+    // Keyed by bit pattern, so 0.0 and -0.0 get registers of their own.
+    auto inserted = constant_registers.try_emplace (bit_cast<uint64_t> (value),
+                                                    function->num_registers);
+    if (inserted.second) {
+        function->num_registers++;
+        function->constants.push_back ({(uint16_t) inserted.first->second, value});
+    }
+    return inserted.first->second;
+}
+
+uint32_t BytecodeCompiler::binary (char op, uint32_t lhs, uint32_t rhs) {
+    switch (op) {
+    case '+':
+        return emit (OP_ADD, lhs, rhs);
+    case '-':
+        return emit (OP_SUB, lhs, rhs);
+    case '*':
+        return emit (OP_MUL, lhs, rhs);
+    case '<':
+        return emit (OP_LESS, lhs, rhs);
+    default:
+        return log_error_r (diagnostics, SourceLocation (), "invalid binary operator");
+    }
+}
+
+uint32_t BytecodeCompiler::call (Symbol callee_name, ArrayRef<uint32_t> args,
+                                 SourceLocation location) {
+    CallSite site;
+    site.name = callee_name;
+    size_t callee_arity;
+
+    if (callee_name == function->name) {
+        site.function = function.get ();
+        callee_arity = function->num_args;
+    } else if (const BytecodeFunction *callee = interpreter.get_function (callee_name)) {
+        site.function = callee;
+        callee_arity = callee->num_args;
+    } else {
+        auto proto_it = function_protos.find (callee_name);
+        if (proto_it == function_protos.end ())
+            return log_error_r (diagnostics, location, "Unknown function referenced");
+
+        callee_arity = proto_it->second->get_args ().size ();
+        site.native = sys::DynamicLibrary::SearchForAddressOfSymbol (callee_name.str ().str ());
+        if (!site.native)
+            return log_error_r (diagnostics, location, "Unresolved external function");
+        if (callee_arity > max_native_args)
+            return log_error_r (diagnostics, location, "Too many arguments to an extern called from the interpreter");
+    }
+
+    if (callee_arity != args.size ())
+        return log_error_r (diagnostics, location, "Incorrect # arguments passed");
+
+    site.first_arg = function->call_args.size ();
+    site.num_args = args.size ();
+    for (uint32_t arg : args)
+        function->call_args.push_back (arg);
+
+    function->calls.push_back (site);
+    return emit (site.function ? OP_CALL : OP_CALL_NATIVE, function->calls.size () - 1, 0);
+}
+
+uint32_t NumberExprAST::compile_bytecode (BytecodeCompiler &compiler) {
+    return compiler.constant (num_value);
+}
+
+uint32_t VariableExprAST::compile_bytecode (BytecodeCompiler &compiler) {
+    return compiler.argument (name, location);
+}
+
+uint32_t BinaryExprAST::compile_bytecode (BytecodeCompiler &compiler) {
+    uint32_t L = compiler.compile_expr (LHS);
+    uint32_t R = compiler.compile_expr (RHS);
+    if (L == BytecodeCompiler::invalid_register || R == BytecodeCompiler::invalid_register)
+        return BytecodeCompiler::invalid_register;
+
+    return compiler.binary (op, L, R);
+}
+
+uint32_t CallExprAST::compile_bytecode (BytecodeCompiler &compiler) {
+    SmallVector<uint32_t, 8> arg_registers;
+    for (ExprAST *arg : get_args ()) {
+        arg_registers.push_back (compiler.compile_expr (arg));
+        if (arg_registers.back () == BytecodeCompiler::invalid_register)
+            return BytecodeCompiler::invalid_register;
+    }
+
+    return compiler.call (name, arg_registers, location);
+}
+
+uint32_t FlatExprAST::compile_bytecode (BytecodeCompiler &compiler) {
+    // Same forward sweep as FlatExprAST::codegen.
+    std::vector<uint32_t> registers (nodes.size ());
+    SmallVector<uint32_t, 8> arg_registers;
+
+    for (size_t i = 0, e = nodes.size (); i != e; ++i) {
+        const Node &node = nodes[i];
+        uint32_t reg = BytecodeCompiler::invalid_register;
+
+        switch (node.kind) {
+        case NODE_NUMBER:
+            reg = compiler.constant (node.number);
+            break;
+        case NODE_VARIABLE:
+            reg = compiler.argument (identifiers[node.name], locations[i]);
+            break;
+        case NODE_BINARY:
+            reg = compiler.binary (node.op, registers[node.binary.lhs], registers[node.binary.rhs]);
+            break;
+        case NODE_CALL:
+            arg_registers.clear ();
+            for (uint32_t arg = 0; arg != node.call.num_args; ++arg)
+                arg_registers.push_back (registers[call_args[node.call.first_arg + arg]]);
+
+            reg = compiler.call (identifiers[node.name], arg_registers, locations[i]);
+            break;
+        }
+
+        if (reg == BytecodeCompiler::invalid_register)
+            return reg;
+        registers[i] = reg;
+    }
+
+    return registers[root.index];
+}
+
+std::unique_ptr<BytecodeFunction> FunctionAST::compile_bytecode (BytecodeCompiler &compiler) {
+    TimeRegion region (phase_timer (compiler.timers, &PhaseTimers::bytecode));
+    TimeTraceScope trace ("CompileBytecode", prototype->get_name ().str ());
+
+    compiler.begin (*prototype);
+    uint32_t result = flat_body ? flat_body->compile_bytecode (compiler)
+                                : compiler.compile_expr (body);
+    return compiler.finish (result);
+}
+
+void BytecodeFunction::print (raw_ostream &out) const {
+    out << "bytecode " << name.str () << " (" << num_args << " args, "
+        << num_registers << " registers)\n";
+
+    for (const Constant &constant : constants)
+        out << "  r" << constant.reg << " = const " << format ("%g", constant.value) << "\n";
+
+    static const char *const opcode_names[] = {"add", "sub", "mul", "lt"};
+
+    for (const Instruction &instr : code) {
+        switch (instr.opcode) {
+        case OP_CALL:
+        case OP_CALL_NATIVE: {
+            const CallSite &site = calls[instr.lhs];
+            out << "  r" << instr.dest << " = call " << site.name.str () << "(";
+            for (uint32_t arg = 0; arg != site.num_args; ++arg)
+                out << (arg ? ", r" : "r") << call_args[site.first_arg + arg];
+            out << ")\n";
+            break;
+        }
+        case OP_RET:
+            out << "  ret r" << instr.lhs << "\n";
+            break;
+        default:
+            out << "  r" << instr.dest << " = " << opcode_names[instr.opcode]
+                << " r" << instr.lhs << ", r" << instr.rhs << "\n";
+            break;
+        }
+    }
+}
+
+Interpreter::Interpreter ()
+    : stack (new double[interpreter_stack_size]), stack_end (stack.get () + interpreter_stack_size) {
+    // Lets externs resolve against everything linked into the host process.
+    sys::DynamicLibrary::LoadLibraryPermanently (nullptr);
+}
+
+const BytecodeFunction *Interpreter::get_function (Symbol name) const {
+    auto function_it = functions.find (name);
+    return function_it == functions.end () ? nullptr : function_it->second.get ();
+}
+
+void Interpreter::add_function (std::unique_ptr<BytecodeFunction> function) {
+    Symbol name = function->name;
+    functions[name] = std::move(function);
+}
+
+double Interpreter::run (const BytecodeFunction &function) {
+    assert (function.num_args == 0 && "only top-level expressions can be run directly");
+
+    if (stack.get () + function.num_registers > stack_end)
+        report_interpreter_stack_overflow ();
+
+    return execute (function, stack.get ());
+}
+
+static double call_native (void *address, const double *args, unsigned num_args) {
+    switch (num_args) {
+    case 0: return ((double (*) ()) address) ();
+    case 1: return ((double (*) (double)) address) (args[0]);
+    case 2: return ((double (*) (double, double)) address) (args[0], args[1]);
+    case 3: return ((double (*) (double, double, double)) address) (args[0], args[1], args[2]);
+    case 4:
+        return ((double (*) (double, double, double, double)) address) (args[0], args[1], args[2],
+                                                                        args[3]);
+    case 5:
+        return ((double (*) (double, double, double, double, double)) address) (
+            args[0], args[1], args[2], args[3], args[4]);
+    case 6:
+        return ((double (*) (double, double, double, double, double, double)) address) (
+            args[0], args[1], args[2], args[3], args[4], args[5]);
+    default:
+        llvm_unreachable ("extern arity is checked when the call is compiled");
+    }
+}
+
+double Interpreter::execute (const BytecodeFunction &function, double *registers) {
+    // Threaded dispatch with computed gotos (a GCC and Clang extension): every
+    // handler ends in its own indirect jump to the next one, which the branch
+    // predictor tracks separately. Listed in Opcode order.
+    static const void *const handlers[] = {
+        &&op_add, &&op_sub, &&op_mul, &&op_less, &&op_call, &&op_call_native, &&op_ret,
+    };
+
+    for (const Constant &constant : function.constants)
+        registers[constant.reg] = constant.value;
+
+    const Instruction *instr = function.code.data ();
+
+#define DISPATCH() goto *handlers[instr->opcode]
+#define NEXT() do { ++instr; DISPATCH (); } while (0)
+
+    DISPATCH ();
+
+op_add:
+    registers[instr->dest] = registers[instr->lhs] + registers[instr->rhs];
+    NEXT ();
+
+op_sub:
+    registers[instr->dest] = registers[instr->lhs] - registers[instr->rhs];
+    NEXT ();
+
+op_mul:
+    registers[instr->dest] = registers[instr->lhs] * registers[instr->rhs];
+    NEXT ();
+
+op_less:
+    // Unordered, like the IR's fcmp ult: a NaN operand yields 1.
+    registers[instr->dest] = !(registers[instr->lhs] >= registers[instr->rhs]) ? 1.0 : 0.0;
+    NEXT ();
+
+op_call: {
+    const CallSite &site = function.calls[instr->lhs];
+    const BytecodeFunction &callee = *site.function;
+
+    // The callee's frame starts right past the caller's.
+    double *frame = registers + function.num_registers;
+    if (frame + callee.num_registers > stack_end || depth == max_call_depth)
+        report_interpreter_stack_overflow ();
+
+    for (uint32_t arg = 0; arg != site.num_args; ++arg)
+        frame[arg] = registers[function.call_args[site.first_arg + arg]];
+
+    if (void *native = callee.native.load (std::memory_order_acquire)) {
+        registers[instr->dest] = call_native (native, frame, site.num_args);
+        NEXT ();
+    }
+
+    if (++callee.num_calls == tier_up_threshold && on_hot_function)
+        on_hot_function (callee);
+
+    ++depth;
+    registers[instr->dest] = execute (callee, frame);
+    --depth;
+    NEXT ();
+}
+
+op_call_native: {
+    const CallSite &site = function.calls[instr->lhs];
+
+    double args[max_native_args];
+    for (uint32_t arg = 0; arg != site.num_args; ++arg)
+        args[arg] = registers[function.call_args[site.first_arg + arg]];
+
+    registers[instr->dest] = call_native (site.native, args, site.num_args);
+    NEXT ();
+}
+
+op_ret:
+    return registers[instr->lhs];
+
+#undef NEXT
+#undef DISPATCH
+}
+
+
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+//--------------------------------------------------------------------------------
+// TOP-LEVEL PARSING
+//--------------------------------------------------------------------------------
+//flexxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx
+
+static bool get_opt_level (OptimizationLevel &level) {
+  switch (opt_level) {
+  case '0': level = OptimizationLevel::O0; return true;
+  case '1': level = OptimizationLevel::O1; return true;
+  case '2': level = OptimizationLevel::O2; return true;
+  case '3': level = OptimizationLevel::O3; return true;
+  default:  return false;
+  }
+}
+
+static CodeGenOpt::Level get_codegen_opt_level () {
+  switch (opt_level) {
+  case '0': return CodeGenOpt::None;
+  case '1': return CodeGenOpt::Less;
+  case '3': return CodeGenOpt::Aggressive;
+  default:  return CodeGenOpt::Default;
+  }
+}
+
+namespace {
+
+// On-disk cache of JIT-compiled definitions. A module whose identifier carries
+// a cache key has its object written to <directory>/<key>.o once ORC compiles
+// it; later runs load that object and skip codegen for the definition.
+class ObjectFileCache: public ObjectCache {
+    std::string directory;
+
+    std::string get_path (StringRef key) const { return (directory + "/" + key + ".o").str(); }
+    static bool get_key (const Module &module, StringRef &key);
+
+    public:
+        explicit ObjectFileCache (StringRef directory);
+
+        static std::string get_module_identifier (StringRef key);
+
+        std::unique_ptr<MemoryBuffer> load (StringRef key);
+
+        void notifyObjectCompiled (const Module *module, MemoryBufferRef object) override;
+        std::unique_ptr<MemoryBuffer> getObject (const Module *module) override;
+};
+
+struct CompilerOptions {
+    OptimizationLevel opt_level = OptimizationLevel::O2;
+    CodeGenOpt::Level codegen_opt_level = CodeGenOpt::Default;
+    bool flat_ast = false;
+    bool fast_math = false;
+    bool lazy = false;
+    bool interpret = false;
+    unsigned tier_up_threshold = 0;
+    bool batch = false;
+    bool async = false;
+    bool compile_only = false;
+    bool time_report = false;
+    OutputLevel output_level = OutputLevel::IR;
+    unsigned jobs = 1;
+    std::string cache_dir;
+    unsigned max_errors = 0;
+};
+
+class Compiler;
+
+// Stands in for a parsed definition inside the implementation dylib. Nothing
+// is generated for the body until the first call through its lazy stub asks
+// the JIT for the symbol.
+class FunctionASTMaterializationUnit: public orc::MaterializationUnit {
+    Compiler &compiler;
+    std::unique_ptr<FunctionAST> function;
+
+    void discard (const orc::JITDylib &, const orc::SymbolStringPtr &) override {
+        llvm_unreachable ("Kaleidoscope functions are not overridable");
+    }
+
+    public:
+        FunctionASTMaterializationUnit (Compiler &compiler, std::unique_ptr<FunctionAST> function,
+                                        orc::SymbolFlagsMap symbols);
+
+        StringRef getName () const override { return "FunctionASTMaterializationUnit"; }
+        void materialize (std::unique_ptr<orc::MaterializationResponsibility> responsibility) override;
+};
+
+// What a codegen worker produced for one definition of a parallel build.
+struct CompiledDefinition {
+    std::string ir;
+    orc::ThreadSafeModule module;
+    std::unique_ptr<MemoryBuffer> object;
+};
+
+// A definition handed to the --async compile pool. A worker fills in `result`
+// and `compiled` becomes ready once it is done; the rest belongs to the input
+// thread.
+struct AsyncDefinition {
+    std::unique_ptr<FunctionAST> function;
+    std::string cache_key;
+    CompiledDefinition result;
+    std::shared_future<void> compiled;
+    bool printed = false;
+};
+
+// Codegen state of an --async pool thread, recycled from job to job. Its copy
+// of the prototypes is caught up with the published ones before each job.
+struct AsyncWorker {
+    std::unique_ptr<TargetMachine> machine;
+    PrototypeMap protos;
+    size_t num_synced_protos = 0;
+    std::unique_ptr<CodeGenContext> codegen;
+};
+
+// Stands in for an --async definition in the main dylib. Looking up one of its
+// symbols, i.e. running code that calls it, waits for the compile to finish.
+class AsyncDefinitionMaterializationUnit: public orc::MaterializationUnit {
+    Compiler &compiler;
+    std::shared_ptr<AsyncDefinition> definition;
+
+    void discard (const orc::JITDylib &, const orc::SymbolStringPtr &) override {
+        llvm_unreachable ("Kaleidoscope functions are not overridable");
+    }
+
+    public:
+        AsyncDefinitionMaterializationUnit (Compiler &compiler,
+                                            std::shared_ptr<AsyncDefinition> definition,
+                                            orc::SymbolFlagsMap symbols);
+
+        StringRef getName () const override { return "AsyncDefinitionMaterializationUnit"; }
+        void materialize (std::unique_ptr<orc::MaterializationResponsibility> responsibility) override;
+};
+
+// One independent compiler instance: its own lexer, parser, JIT and codegen
+// state. Nothing here is shared between instances, so each worker thread can
+// drive a Compiler of its own.
+class Compiler {
+    CompilerOptions options;
+    std::unique_ptr<PhaseTimers> timers;
+    Lexer lexer;
+    Diagnostics diagnostics {&lexer.get_source ()};
+    Parser parser;
+    PrototypeMap function_protos;
+    std::unique_ptr<TargetMachine> target_machine;
+    std::unique_ptr<ObjectFileCache> object_cache;
+    std::unique_ptr<orc::LLJIT> jit;
+    std::unique_ptr<CodeGenContext> codegen;
+
+    // Definitions handed to the JIT or the output module so far. Each body
+    // gets a module of its own, so redefinitions are caught here rather than
+    // by the JIT.
+    DenseSet<Symbol> defined_functions;
+
+    // Only set up with --lazy: definitions live in impl_dylib and the main
+    // dylib exports a compile-on-first-call stub for each of them.
+    std::unique_ptr<orc::LazyCallThroughManager> lazy_call_through;
+    std::unique_ptr<orc::IndirectStubsManager> lazy_stubs;
+    orc::JITDylib *impl_dylib = nullptr;
+
+    // Only set up with --interpret: definitions and top-level expressions run
+    // as bytecode and never reach LLVM codegen.
+    std::unique_ptr<Interpreter> interpreter;
+
+    // Only set up with --tier-up: hot definitions are recompiled into the JIT
+    // on a single background thread, so jobs finish in the order they were
+    // queued. The ASTs are kept for that, and each definition is queued once.
+    DenseMap<Symbol, std::unique_ptr<FunctionAST>> interpreted_definitions;
+    DenseSet<Symbol> tier_up_requested;
+    std::unique_ptr<TargetMachine> tier_up_machine;
+    std::unique_ptr<ThreadPool> tier_up_pool;
+    std::atomic<bool> shutting_down {false};
+    std::atomic<uint64_t> num_tiered_up {0};
+
+    // Only set up with --async. The mutex guards the prototypes published for
+    // the workers and the idle worker states.
+    std::unique_ptr<ThreadPool> async_pool;
+    std::vector<std::shared_ptr<AsyncDefinition>> async_definitions;
+    std::mutex async_mutex;
+    std::vector<std::shared_ptr<PrototypeAST>> published_protos;
+    std::vector<std::unique_ptr<AsyncWorker>> idle_async_workers;
+
+    // Workers of a -j build add to this concurrently.
+    std::atomic<uint64_t> num_ir_instructions {0};
+
+    /// Whether messages of `level` are shown; IR is the most verbose.
+    bool prints (OutputLevel level) const { return options.output_level >= level; }
+
+    std::string get_cache_key (const FunctionAST &function);
+    bool codegen_definition (FunctionAST &function, CodeGenContext &ctx, raw_ostream &ir);
+    void define_lazily (std::unique_ptr<FunctionAST> function);
+
+    void codegen_worker (ArrayRef<std::unique_ptr<FunctionAST>> functions,
+                         MutableArrayRef<CompiledDefinition> results, size_t first, size_t stride);
+    void link_module (orc::ThreadSafeModule module);
+
+    void publish_prototype (Symbol name);
+    void compile_async (std::unique_ptr<FunctionAST> function);
+    void compile_async_definition (AsyncDefinition &definition, size_t num_protos);
+    std::unique_ptr<AsyncWorker> acquire_async_worker (size_t num_protos);
+    void print_async_output (AsyncDefinition &definition);
+
+    std::unique_ptr<BytecodeFunction> compile_bytecode (FunctionAST &function);
+    void define_bytecode (std::unique_ptr<FunctionAST> function);
+    void interpret_toplevel_expression (FunctionAST &function);
+
+    using TierUpFunction = std::pair<FunctionAST *, const BytecodeFunction *>;
+    void request_tier_up (const BytecodeFunction &hot);
+    void tier_up (ArrayRef<TierUpFunction> functions, PrototypeMap &protos);
+
+    bool is_new_definition (const FunctionAST &function);
+    void handle_definition ();
+    void handle_extern ();
+    void handle_toplevel_expression ();
+    void run_toplevel_expression (std::unique_ptr<FunctionAST> function);
+
+    void start_counting_errors ();
+    bool too_many_errors ();
+
+    public:
+        Compiler (const CompilerOptions &options);
+        ~Compiler ();
+
+        void stop_tier_up ();
+
+        Lexer &get_lexer () { return lexer; }
+        const Diagnostics &get_diagnostics () const { return diagnostics; }
+
+        void materialize_definition (std::unique_ptr<orc::MaterializationResponsibility> responsibility,
+                                     std::unique_ptr<FunctionAST> function);
+        void materialize_async_definition (std::unique_ptr<orc::MaterializationResponsibility> responsibility,
+                                           AsyncDefinition &definition);
+
+        void main_loop ();
+        void parallel_loop ();
+        void finish_async_compiles ();
+        void print_prompt ();
+        void print_module ();
+        void print_report ();
+        bool emit_object (StringRef filename);
+};
+
+}
+
+FunctionASTMaterializationUnit::FunctionASTMaterializationUnit (
+    Compiler &compiler, std::unique_ptr<FunctionAST> function, orc::SymbolFlagsMap symbols)
+    : MaterializationUnit (Interface (std::move(symbols), nullptr)),
+      compiler (compiler), function (std::move(function)) {}
+
+void FunctionASTMaterializationUnit::materialize (
+    std::unique_ptr<orc::MaterializationResponsibility> responsibility) {
+    compiler.materialize_definition (std::move(responsibility), std::move(function));
+}
+
+AsyncDefinitionMaterializationUnit::AsyncDefinitionMaterializationUnit (
+    Compiler &compiler, std::shared_ptr<AsyncDefinition> definition, orc::SymbolFlagsMap symbols)
+    : MaterializationUnit (Interface (std::move(symbols), nullptr)),
+      compiler (compiler), definition (std::move(definition)) {}
+
+void AsyncDefinitionMaterializationUnit::materialize (
+    std::unique_ptr<orc::MaterializationResponsibility> responsibility) {
+    compiler.materialize_async_definition (std::move(responsibility), *definition);
+}
+
+// Reports an error from the JIT. A symbol only fails to materialize once its
+// cause (a body that did not compile, an unresolved extern, ...) has been
+// reported, so those follow-on failures are neither printed nor counted.
+static void report_jit_error (Diagnostics &diagnostics, Error error) {
+    handleAllErrors (std::move(error),
+                     [] (const orc::FailedToMaterialize &) {},
+                     [&] (const ErrorInfoBase &info) {
+                         log_error (&diagnostics, info.message ().c_str ());
+                     });
+}
+
+// Lazy stubs jump here, in place of the call, when compiling the body behind
+// them failed. That failure is already reported; the result stands in for
+// the call's.
+static double lazy_compile_failed () {
+    return NAN;
+}
+
+static const char cache_module_prefix[] = "lang-cache:";
+
+ObjectFileCache::ObjectFileCache (StringRef directory): directory (directory) {
+    sys::fs::create_directories (directory);
+}
+
+std::string ObjectFileCache::get_module_identifier (StringRef key) {
+    return (cache_module_prefix + key).str();
+}
+
+bool ObjectFileCache::get_key (const Module &module, StringRef &key) {
+    key = module.getModuleIdentifier ();
+    return key.consume_front (cache_module_prefix);
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::load (StringRef key) {
+    auto buffer_or_err = MemoryBuffer::getFile (get_path (key), /*IsText=*/false,
+                                                /*RequiresNullTerminator=*/false);
+    if (!buffer_or_err)
+        return nullptr;
+
+    return std::move(*buffer_or_err);
+}
+
+void ObjectFileCache::notifyObjectCompiled (const Module *module, MemoryBufferRef object) {
+    StringRef key;
+    if (!get_key (*module, key))
+        return;
+
+    // Write under a unique name and rename into place, so workers sharing the
+    // directory never map a half-written object. The cache is best effort:
+    // on any failure the definition is simply compiled again next time.
+    std::string path = get_path (key);
+    SmallString<128> temp_path;
+    int fd;
+    if (sys::fs::createUniqueFile (path + ".tmp%%%%%%", fd, temp_path))
+        return;
+
+    {
+        raw_fd_ostream out (fd, /*shouldClose=*/true);
+        out << object.getBuffer ();
+    }
+
+    if (sys::fs::rename (temp_path, path))
+        sys::fs::remove (temp_path);
+}
+
+std::unique_ptr<MemoryBuffer> ObjectFileCache::getObject (const Module *module) {
+    StringRef key;
+    if (!get_key (*module, key))
+        return nullptr;
+
+    return load (key);
+}
+
+static orc::JITTargetMachineBuilder get_target_machine_builder (const CompilerOptions &options) {
+    auto builder = exit_on_err (orc::JITTargetMachineBuilder::detectHost());
+    builder.setCodeGenOptLevel (options.codegen_opt_level);
+
+    // Objects built with -c get linked into position-independent executables.
+    if (options.compile_only)
+        builder.setRelocationModel (Reloc::PIC_);
+
+    return builder;
+}
+
+Compiler::Compiler (const CompilerOptions &options)
+    : options (options), parser (lexer) {
+    parser.set_diagnostics (&diagnostics);
+    parser.set_flat_ast (options.flat_ast);
+    parser.set_fast_math (options.fast_math);
+
+    if (options.time_report) {
+        timers = std::make_unique<PhaseTimers> ();
+        parser.set_timers (timers.get ());
+    }
+
+    auto jit_target_machine_builder = get_target_machine_builder (options);
+    target_machine = exit_on_err (jit_target_machine_builder.createTargetMachine());
+
+    if (options.interpret)
+        interpreter = std::make_unique<Interpreter> ();
+
+    // With -c everything goes into one module that is written out at the end,
+    // so there is nothing to run and no JIT to set up. The interpreter runs
+    // everything itself and only needs the JIT to tier up.
+    if (!options.compile_only && (!options.interpret || options.tier_up_threshold)) {
+        // Tiered-up code is hot by definition, so it gets the best codegen.
+        if (options.interpret)
+            jit_target_machine_builder.setCodeGenOptLevel (CodeGenOpt::Aggressive);
+
+        orc::LLJITBuilder jit_builder;
+        jit_builder.setJITTargetMachineBuilder (std::move(jit_target_machine_builder));
+
+        if (!options.cache_dir.empty ()) {
+            object_cache = std::make_unique<ObjectFileCache> (options.cache_dir);
+
+            auto *cache = object_cache.get ();
+            jit_builder.setCompileFunctionCreator (
+                [cache] (orc::JITTargetMachineBuilder builder)
+                    -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+                    auto machine = builder.createTargetMachine ();
+                    if (!machine)
+                        return machine.takeError ();
+
+                    return std::make_unique<orc::TMOwningSimpleCompiler> (std::move(*machine), cache);
+                });
+        }
+
+        jit = exit_on_err (jit_builder.create ());
+
+        // Failures inside the JIT (e.g. an unresolved extern) count towards
+        // --max-errors like any other error.
+        jit->getExecutionSession ().setErrorReporter ([this] (Error error) {
+            report_jit_error (diagnostics, std::move(error));
+        });
+
+        // Resolve externs (sin, cos, ...) against symbols of the host process.
+        jit->getMainJITDylib().addGenerator (exit_on_err (
+            orc::DynamicLibrarySearchGenerator::GetForCurrentProcess (
+                jit->getDataLayout().getGlobalPrefix())));
+
+        if (options.lazy) {
+            auto &session = jit->getExecutionSession ();
+            const Triple &triple = jit->getTargetTriple ();
+
+            lazy_call_through = exit_on_err (orc::createLocalLazyCallThroughManager (
+                triple, session, pointerToJITTargetAddress (&lazy_compile_failed)));
+            lazy_stubs = orc::createLocalIndirectStubsManagerBuilder (triple) ();
+
+            // Bodies only see the main dylib, so calls between definitions go
+            // through the stubs too and stay lazy.
+            impl_dylib = &session.createBareJITDylib ("<impl>");
+            impl_dylib->setLinkOrder ({{&jit->getMainJITDylib (),
+                                        orc::JITDylibLookupFlags::MatchAllSymbols}},
+                                      /*LinkAgainstThisJITDylibFirst=*/false);
+        }
+    }
+
+    if (interpreter && jit) {
+        tier_up_machine = exit_on_err (get_target_machine_builder (options).createTargetMachine ());
+        tier_up_pool = std::make_unique<ThreadPool> (hardware_concurrency (1));
+        interpreter->set_tier_up (options.tier_up_threshold, [this] (const BytecodeFunction &hot) {
+            request_tier_up (hot);
+        });
+    }
+
+    // The interpreter and --lazy don't compile definitions as they are read
+    // anyway.
+    if (options.async && !options.interpret && !options.lazy)
+        async_pool = std::make_unique<ThreadPool> (hardware_concurrency (options.jobs));
+
+    codegen = std::make_unique<CodeGenContext> (function_protos, target_machine.get(),
+                                                options.opt_level);
+    codegen->timers = timers.get ();
+    codegen->diagnostics = &diagnostics;
+}
+
+Compiler::~Compiler () {
+    stop_tier_up ();
+
+    // Jobs still running refer to this compiler.
+    async_pool.reset ();
+}
+
+/// Waits for the tier-up job in flight, skipping the queued ones: once the
+/// input is done there is nothing left to speed up.
+void Compiler::stop_tier_up () {
+    shutting_down = true;
+    tier_up_pool.reset ();
+}
+
+/// Derives the object cache key for a definition from its AST and everything
+/// else that shapes the generated code.
+std::string Compiler::get_cache_key (const FunctionAST &function) {
+    MD5 hash;
+    hash.update ("lang object cache v1");
+    hash.update (LLVM_VERSION_STRING);
+    hash.update (target_machine->getTargetTriple ().str ());
+    hash.update (target_machine->getTargetCPU ());
+    hash.update (target_machine->getTargetFeatureString ());
+    hash_bytes (hash, options.opt_level.getSpeedupLevel ());
+    hash_bytes (hash, options.opt_level.getSizeLevel ());
+    hash_bytes (hash, options.codegen_opt_level);
+    hash_bytes (hash, options.batch);
+    function.hash (hash, function_protos);
+
+    MD5::MD5Result result;
+    hash.final (result);
+    return std::string (result.digest ());
+}
+
+/// Generates a definition, plus its batch entry point with --batch, and
+/// prints the IR of both to `ir` at the IR output level.
+bool Compiler::codegen_definition (FunctionAST &function, CodeGenContext &ctx, raw_ostream &ir) {
+    auto *FnIR = function.codegen (ctx);
+    if (!FnIR)
+        return false;
+
+    num_ir_instructions += FnIR->getInstructionCount ();
+    Function *BatchIR = options.batch ? function.codegen_batch (ctx) : nullptr;
+    if (BatchIR)
+        num_ir_instructions += BatchIR->getInstructionCount ();
+
+    if (prints (OutputLevel::IR)) {
+        TimeRegion region (phase_timer (ctx.timers, &PhaseTimers::print));
+        FnIR->print (ir);
+        if (BatchIR) {
+            ir << "\n";
+            BatchIR->print (ir);
+        }
+        ir << "\n";
+    }
+
+    return true;
+}
+
+void Compiler::define_lazily (std::unique_ptr<FunctionAST> function) {
+    // Publish the prototype right away so later code can call the function.
+    PrototypeAST &proto = function->register_prototype (function_protos);
+    auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+
+    orc::SymbolFlagsMap symbols;
+    symbols[jit->mangleAndIntern (proto.get_name ().str ())] = flags;
+    if (options.batch)
+        symbols[jit->mangleAndIntern ((proto.get_name ().str () + "_batch").str ())] = flags;
+
+    orc::SymbolAliasMap stubs;
+    for (auto &symbol : symbols)
+        stubs[symbol.first] = {symbol.first, flags};
+
+    exit_on_err (impl_dylib->define (std::make_unique<FunctionASTMaterializationUnit> (
+        *this, std::move(function), std::move(symbols))));
+
+    exit_on_err (jit->getMainJITDylib ().define (
+        orc::lazyReexports (*lazy_call_through, *lazy_stubs, *impl_dylib, std::move(stubs))));
+}
+
+/// Generates a lazily defined function on its first call. Every body gets a
+/// module and codegen context of its own, since it can be requested while the
+/// main context is in the middle of another module.
+void Compiler::materialize_definition (std::unique_ptr<orc::MaterializationResponsibility> responsibility,
+                                       std::unique_ptr<FunctionAST> function) {
+    std::string cache_key;
+    if (object_cache) {
+        cache_key = get_cache_key (*function);
+
+        if (auto object = object_cache->load (cache_key)) {
+            if (prints (OutputLevel::Summary))
+                fprintf (stderr, "Loaded the func. definition from the object cache\n");
+            jit->getObjLinkingLayer ().emit (std::move(responsibility), std::move(object));
+            return;
+        }
+    }
+
+    CodeGenContext function_codegen (function_protos, target_machine.get(), options.opt_level);
+    function_codegen.timers = timers.get ();
+    function_codegen.diagnostics = &diagnostics;
+    if (!codegen_definition (*function, function_codegen, errs())) {
+        responsibility->failMaterialization ();
+        return;
+    }
+
+    if (!cache_key.empty ())
+        function_codegen.module->setModuleIdentifier (ObjectFileCache::get_module_identifier (cache_key));
+
+    jit->getIRTransformLayer ().emit (std::move(responsibility), function_codegen.take_module ());
+}
+
+bool Compiler::is_new_definition (const FunctionAST &function) {
+    if (defined_functions.count (function.get_name ())) {
+        log_error (&diagnostics, function.get_location (), "Function cannot be redefined.");
+        return false;
+    }
+
+    auto previous_proto = function_protos.lookup (function.get_name ());
+    if (previous_proto && previous_proto->get_args ().size () != function.get_args ().size ()) {
+        log_error (&diagnostics, function.get_location (),
+                   "Function redefined with a different number of arguments");
+        return false;
+    }
+
+    return true;
+}
+
+void Compiler::handle_definition () {
+    if (auto FnAST = parser.parse_definition ()) {
+        if (prints (OutputLevel::Summary))
+            fprintf (stderr, "Parsed a func. definition\n");
+
+        if (!is_new_definition (*FnAST))
+            return;
+
+        if (interpreter) {
+            define_bytecode (std::move(FnAST));
+            return;
+        }
+
+        // Lazy and async definitions are in the JIT from here on, even if
+        // their body fails to compile later.
+        if (impl_dylib) {
+            defined_functions.insert (FnAST->get_name ());
+            define_lazily (std::move(FnAST));
+            return;
+        }
+
+        if (async_pool) {
+            defined_functions.insert (FnAST->get_name ());
+            compile_async (std::move(FnAST));
+            return;
+        }
+
+        std::string cache_key;
+        if (object_cache) {
+            cache_key = get_cache_key (*FnAST);
+
+            if (auto object = object_cache->load (cache_key)) {
+                if (prints (OutputLevel::Summary))
+                    fprintf (stderr, "Loaded the func. definition from the object cache\n");
+                FnAST->register_prototype (function_protos);
+                defined_functions.insert (FnAST->get_name ());
+                exit_on_err (jit->addObjectFile (std::move(object)));
+                return;
+            }
+        }
+
+        if (codegen_definition (*FnAST, *codegen, errs())) {
+            defined_functions.insert (FnAST->get_name ());
+            if (!cache_key.empty ())
+                codegen->module->setModuleIdentifier (ObjectFileCache::get_module_identifier (cache_key));
+
+            // Hand the module with the new definition over to the JIT and
+            // open a fresh one for whatever comes next.
+            if (jit)
+                exit_on_err (jit->addIRModule (codegen->take_module ()));
         }
     } else
-        get_next_token ();
+        parser.synchronize ();
 }
 
-static void handle_extern  () {
-    if (auto ProtoAST = parse_extern ()){
-        fprintf (stderr, "Parsed an extern\n");
+void Compiler::handle_extern  () {
+    if (auto ProtoAST = parser.parse_extern ()){
+        if (prints (OutputLevel::Summary))
+            fprintf (stderr, "Parsed an extern\n");
+
+        Symbol name = ProtoAST->get_name ();
+        function_protos[name] = std::move(ProtoAST);
+        publish_prototype (name);
 
-        if (auto *FnIR = ProtoAST->codegen()) {
+        if (!prints (OutputLevel::IR))
+            return;
+
+        if (auto *FnIR = codegen->get_function(name)) {
             FnIR->print(errs());
             fprintf(stderr, "\n");
         }
     }
     else
-        get_next_token ();
+        parser.synchronize ();
+}
+
+void Compiler::handle_toplevel_expression () {
+    if (!jit && !interpreter) {
+        // Nothing runs an object file's top-level code, so just step over it.
+        if (parser.parse_toplevel_expression ())
+            fprintf (stderr, "Warning: top-level expression ignored in -c mode\n");
+        else
+            parser.synchronize ();
+        return;
+    }
+
+    if (auto FnAST = parser.parse_toplevel_expression()){
+        if (prints (OutputLevel::Summary))
+            fprintf (stderr, "Parsed an top-level expression\n");
+
+        if (interpreter)
+            interpret_toplevel_expression (*FnAST);
+        else
+            run_toplevel_expression (std::move(FnAST));
+    }
+    else
+        parser.synchronize ();
 }
 
-static void handle_toplevel_expression () {
-    if (auto FnAST = parse_toplevel_expression()){
-        fprintf (stderr, "Parsed an top-level expression\n");
-        if (auto *FnIR = FnAST->codegen()) {
+void Compiler::run_toplevel_expression (std::unique_ptr<FunctionAST> FnAST) {
+    if (auto *FnIR = FnAST->codegen(*codegen)) {
+        num_ir_instructions += FnIR->getInstructionCount ();
+        if (prints (OutputLevel::IR)) {
+            TimeRegion region (phase_timer (timers.get (), &PhaseTimers::print));
             FnIR->print(errs());
             fprintf(stderr, "\n");
+        }
+
+        TimeTraceScope trace ("Evaluate");
+
+        // Track the memory of the anonymous expression's module so it can
+        // be freed once we've run it.
+        auto tracker = jit->getMainJITDylib().createResourceTracker();
+        exit_on_err (jit->addIRModule (tracker, codegen->take_module ()));
 
-            // Remove the anonymous expression.
-            FnIR->eraseFromParent();
+        // Compile __anon_expr (and every def it reaches) to native code. That
+        // fails if one of them did not compile.
+        auto expr_symbol = jit->lookup ("__anon_expr");
+        if (!expr_symbol) {
+            report_jit_error (diagnostics, expr_symbol.takeError ());
+            exit_on_err (tracker->remove ());
+            return;
         }
+
+        auto *fp = (double (*)()) (intptr_t) expr_symbol->getAddress();
+        double result = fp ();
+        if (prints (OutputLevel::Summary))
+            fprintf (stderr, "Evaluated to %f\n", result);
+
+        // Delete the anonymous expression module from the JIT.
+        exit_on_err (tracker->remove());
     }
-    else
-        get_next_token ();
 }
 
-static void main_loop () {
-    while (true) {
-        fprintf (stderr, "input: ");
-        switch (current_token) {
+/// Lowers a body to bytecode and prints the listing at the IR output level.
+std::unique_ptr<BytecodeFunction> Compiler::compile_bytecode (FunctionAST &function) {
+    BytecodeCompiler bytecode_compiler (*interpreter, function_protos);
+    bytecode_compiler.timers = timers.get ();
+    bytecode_compiler.diagnostics = &diagnostics;
+
+    auto bytecode = function.compile_bytecode (bytecode_compiler);
+    if (bytecode && prints (OutputLevel::IR)) {
+        TimeRegion region (phase_timer (timers.get (), &PhaseTimers::print));
+        bytecode->print (errs ());
+        errs () << "\n";
+    }
+
+    return bytecode;
+}
+
+void Compiler::define_bytecode (std::unique_ptr<FunctionAST> function) {
+    if (interpreter->get_function (function->get_name ())) {
+        log_error (&diagnostics, function->get_location (), "Function cannot be redefined.");
+        return;
+    }
+
+    if (auto bytecode = compile_bytecode (*function)) {
+        function->register_prototype (function_protos);
+        interpreter->add_function (std::move(bytecode));
+
+        if (tier_up_pool) {
+            Symbol name = function->get_name ();
+            interpreted_definitions[name] = std::move(function);
+        }
+    }
+}
+
+void Compiler::interpret_toplevel_expression (FunctionAST &function) {
+    auto bytecode = compile_bytecode (function);
+    if (!bytecode)
+        return;
+
+    TimeTraceScope trace ("Evaluate");
+
+    double result = interpreter->run (*bytecode);
+    if (prints (OutputLevel::Summary))
+        fprintf (stderr, "Evaluated to %f\n", result);
+}
+
+/// Queues a hot definition for recompilation together with every definition
+/// it reaches that is not queued yet, since the native code calls those
+/// directly. The job gets a snapshot of the prototypes, which the input
+/// thread keeps adding to.
+void Compiler::request_tier_up (const BytecodeFunction &hot) {
+    std::vector<TierUpFunction> functions;
+    SmallVector<const BytecodeFunction *, 8> worklist = {&hot};
+
+    while (!worklist.empty ()) {
+        const BytecodeFunction *bytecode = worklist.pop_back_val ();
+        if (!tier_up_requested.insert (bytecode->name).second)
+            continue;
+
+        functions.emplace_back (interpreted_definitions[bytecode->name].get (), bytecode);
+        for (const CallSite &site : bytecode->calls)
+            if (site.function)
+                worklist.push_back (site.function);
+    }
+
+    if (functions.empty ())
+        return;
+
+    bool trace_thread = timeTraceProfilerEnabled ();
+    tier_up_pool->async ([this, functions, protos = function_protos, trace_thread] () mutable {
+        if (shutting_down)
+            return;
+
+        if (trace_thread)
+            timeTraceProfilerInitialize (time_trace_granularity, "lang");
+
+        tier_up (functions, protos);
+
+        if (trace_thread)
+            timeTraceProfilerFinishThread ();
+    });
+}
+
+/// Runs on the tier-up thread: generates `functions` into one module with the
+/// -O3 pipeline, adds it to the JIT and points their bytecode at the result.
+void Compiler::tier_up (ArrayRef<TierUpFunction> functions, PrototypeMap &protos) {
+    TimeTraceScope trace ("TierUp", functions.front ().first->get_name ().str ());
+
+    CodeGenContext tier_up_codegen (protos, tier_up_machine.get (), OptimizationLevel::O3);
+    tier_up_codegen.diagnostics = &diagnostics;
+    for (const TierUpFunction &function : functions)
+        if (!function.first->codegen (tier_up_codegen))
+            return;
+
+    tier_up_codegen.optimize_module ();
+    if (Error error = jit->addIRModule (tier_up_codegen.take_module ())) {
+        log_error (&diagnostics, ("tier-up failed: " + toString (std::move(error))).c_str ());
+        return;
+    }
+
+    // Interpreted code calls through a fixed-arity C call, see call_native.
+    for (const TierUpFunction &function : functions) {
+        if (function.second->num_args > max_native_args)
+            continue;
+
+        auto symbol = jit->lookup (function.first->get_name ().str ());
+        if (!symbol) {
+            log_error (&diagnostics, ("tier-up failed: " + toString (symbol.takeError ())).c_str ());
+            return;
+        }
+
+        function.second->native.store (jitTargetAddressToPointer<void *> (symbol->getAddress ()),
+                                       std::memory_order_release);
+        ++num_tiered_up;
+    }
+}
+
+/// The REPL never gives up, however many errors it has seen.
+void Compiler::start_counting_errors () {
+    diagnostics.reset_errors (lexer.is_interactive () ? 0 : options.max_errors);
+}
+
+bool Compiler::too_many_errors () {
+    if (!diagnostics.error_limit_reached ())
+        return false;
+
+    fprintf (stderr, "Error: too many errors, stopping\n");
+    return true;
+}
+
+void Compiler::main_loop () {
+    start_counting_errors ();
+    parser.get_next_token ();
+
+    while (!too_many_errors ()) {
+        print_prompt ();
+        switch (parser.get_current_token ()) {
             case TOK_EOF:
                 return;
             case ';':
-                get_next_token ();
+                parser.get_next_token ();
                 break;
             case TOK_DEF:
                 handle_definition ();
@@ -581,19 +3445,442 @@ static void main_loop () {
     }
 }
 
-int main () { 
-    binary_op_precedence['<'] = 10;
-    binary_op_precedence['+'] = 20;
-    binary_op_precedence['-'] = 20;
-    binary_op_precedence['*'] = 40;
+/// Generates code for the definitions with index first, first + stride, ...
+/// Each worker owns its target machine, LLVM contexts and a private copy of
+/// the prototype map, so workers share nothing mutable.
+void Compiler::codegen_worker (ArrayRef<std::unique_ptr<FunctionAST>> functions,
+                               MutableArrayRef<CompiledDefinition> results,
+                               size_t first, size_t stride) {
+    auto worker_machine = exit_on_err (get_target_machine_builder (options).createTargetMachine ());
+    PrototypeMap worker_protos = function_protos;
+    CodeGenContext worker_codegen (worker_protos, worker_machine.get(), options.opt_level);
+    worker_codegen.diagnostics = &diagnostics;
+
+    for (size_t i = first; i < functions.size (); i += stride) {
+        CompiledDefinition &result = results[i];
+
+        std::string cache_key;
+        if (object_cache) {
+            cache_key = get_cache_key (*functions[i]);
+            if ((result.object = object_cache->load (cache_key)))
+                continue;
+        }
+
+        raw_string_ostream ir (result.ir);
+        if (!codegen_definition (*functions[i], worker_codegen, ir))
+            continue;
 
-    fprintf (stderr, "input: ");
-    get_next_token ();
+        if (!cache_key.empty ())
+            worker_codegen.module->setModuleIdentifier (ObjectFileCache::get_module_identifier (cache_key));
+
+        result.module = worker_codegen.take_module ();
+    }
+}
+
+/// Moves a worker's module into the module written out by -c. Modules can't
+/// be linked across LLVM contexts, so it makes a round trip through bitcode.
+void Compiler::link_module (orc::ThreadSafeModule module) {
+    SmallVector<char, 0> bitcode;
+    module.withModuleDo ([&] (Module &source) {
+        raw_svector_ostream out (bitcode);
+        WriteBitcodeToFile (source, out);
+    });
+
+    auto source = exit_on_err (parseBitcodeFile (
+        MemoryBufferRef (StringRef (bitcode.data (), bitcode.size ()), "definition"),
+        *codegen->context));
+
+    if (Linker::linkModules (*codegen->module, std::move(source)))
+        log_error (&diagnostics, "failed to link a definition into the output module");
+}
+
+/// Makes a prototype visible to the --async workers.
+void Compiler::publish_prototype (Symbol name) {
+    if (!async_pool)
+        return;
+
+    std::lock_guard<std::mutex> lock (async_mutex);
+    published_protos.push_back (function_protos[name]);
+}
+
+/// Queues a definition on the --async pool. With a JIT its symbols are
+/// defined right away, so code parsed later can call it; only looking them up
+/// to run such code waits for the compile.
+void Compiler::compile_async (std::unique_ptr<FunctionAST> function) {
+    auto definition = std::make_shared<AsyncDefinition> ();
+    if (object_cache)
+        definition->cache_key = get_cache_key (*function);
+
+    PrototypeAST &proto = function->register_prototype (function_protos);
+    publish_prototype (proto.get_name ());
+    definition->function = std::move(function);
+
+    size_t num_protos;
+    {
+        std::lock_guard<std::mutex> lock (async_mutex);
+        num_protos = published_protos.size ();
+    }
+
+    bool trace_workers = timeTraceProfilerEnabled ();
+    AsyncDefinition *job = definition.get ();
+    definition->compiled = async_pool->async ([this, job, num_protos, trace_workers] {
+        if (trace_workers)
+            timeTraceProfilerInitialize (time_trace_granularity, "lang");
+
+        compile_async_definition (*job, num_protos);
+
+        if (trace_workers)
+            timeTraceProfilerFinishThread ();
+    });
+    async_definitions.push_back (definition);
+
+    if (!jit)
+        return;
+
+    auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    orc::SymbolFlagsMap symbols;
+    symbols[jit->mangleAndIntern (proto.get_name ().str ())] = flags;
+    if (options.batch)
+        symbols[jit->mangleAndIntern ((proto.get_name ().str () + "_batch").str ())] = flags;
+
+    exit_on_err (jit->getMainJITDylib ().define (std::make_unique<AsyncDefinitionMaterializationUnit> (
+        *this, std::move(definition), std::move(symbols))));
+}
+
+/// Takes an idle worker state, or sets up a new one, and catches its
+/// prototypes up with the first `num_protos` published ones.
+std::unique_ptr<AsyncWorker> Compiler::acquire_async_worker (size_t num_protos) {
+    std::unique_ptr<AsyncWorker> worker;
+    std::lock_guard<std::mutex> lock (async_mutex);
+
+    if (!idle_async_workers.empty ()) {
+        worker = std::move(idle_async_workers.back ());
+        idle_async_workers.pop_back ();
+    } else {
+        worker = std::make_unique<AsyncWorker> ();
+        worker->machine = exit_on_err (get_target_machine_builder (options).createTargetMachine ());
+        worker->codegen = std::make_unique<CodeGenContext> (worker->protos, worker->machine.get (),
+                                                            options.opt_level);
+        worker->codegen->diagnostics = &diagnostics;
+    }
+
+    for (; worker->num_synced_protos < num_protos; ++worker->num_synced_protos) {
+        auto &proto = published_protos[worker->num_synced_protos];
+        worker->protos[proto->get_name ()] = proto;
+    }
+
+    return worker;
+}
+
+/// Runs on an --async pool thread.
+void Compiler::compile_async_definition (AsyncDefinition &definition, size_t num_protos) {
+    TimeTraceScope trace ("AsyncCompile", definition.function->get_name ().str ());
+
+    CompiledDefinition &result = definition.result;
+    if (object_cache && (result.object = object_cache->load (definition.cache_key)))
+        return;
+
+    auto worker = acquire_async_worker (num_protos);
+
+    raw_string_ostream ir (result.ir);
+    if (codegen_definition (*definition.function, *worker->codegen, ir)) {
+        if (!definition.cache_key.empty ())
+            worker->codegen->module->setModuleIdentifier (
+                ObjectFileCache::get_module_identifier (definition.cache_key));
+
+        result.module = worker->codegen->take_module ();
+    }
+
+    std::lock_guard<std::mutex> lock (async_mutex);
+    idle_async_workers.push_back (std::move(worker));
+}
+
+/// Shows what compiling a definition printed, once and from the input
+/// thread, so it never interleaves with other output.
+void Compiler::print_async_output (AsyncDefinition &definition) {
+    if (definition.printed)
+        return;
+
+    definition.printed = true;
+    if (definition.result.object && prints (OutputLevel::Summary))
+        fprintf (stderr, "Loaded the func. definition from the object cache\n");
+    fputs (definition.result.ir.c_str (), stderr);
+}
+
+/// Hands an --async definition to the JIT when code that calls it is about to
+/// run, waiting for its compile if it is still queued or in progress.
+void Compiler::materialize_async_definition (std::unique_ptr<orc::MaterializationResponsibility> responsibility,
+                                             AsyncDefinition &definition) {
+    {
+        TimeTraceScope trace ("WaitForCompile", definition.function->get_name ().str ());
+        definition.compiled.wait ();
+    }
+
+    print_async_output (definition);
+
+    CompiledDefinition &result = definition.result;
+    if (result.object)
+        jit->getObjLinkingLayer ().emit (std::move(responsibility), std::move(result.object));
+    else if (result.module)
+        jit->getIRTransformLayer ().emit (std::move(responsibility), std::move(result.module));
+    else
+        responsibility->failMaterialization ();
+}
+
+/// Waits for every --async compile, then prints what has not been shown yet
+/// in source order. With -c the modules are linked into the output here.
+void Compiler::finish_async_compiles () {
+    if (!async_pool)
+        return;
+
+    async_pool->wait ();
 
-    initialize_module ();
+    for (auto &definition : async_definitions) {
+        print_async_output (*definition);
+        if (!jit && definition->result.module)
+            link_module (std::move(definition->result.module));
+    }
+}
+
+/// Like main_loop, but parses the whole input before generating any code, so
+/// definitions can be compiled on a thread pool. Top-level expressions run
+/// once every definition is in the JIT.
+void Compiler::parallel_loop () {
+    std::vector<std::unique_ptr<FunctionAST>> definitions;
+    std::vector<std::shared_ptr<PrototypeAST>> previous_protos;
+    std::vector<std::unique_ptr<FunctionAST>> toplevel_expressions;
+
+    start_counting_errors ();
+    parser.get_next_token ();
+
+    while (parser.get_current_token () != TOK_EOF && !too_many_errors ()) {
+        switch (parser.get_current_token ()) {
+            case ';':
+                parser.get_next_token ();
+                break;
+            case TOK_DEF:
+                if (auto FnAST = parser.parse_definition ()) {
+                    if (!is_new_definition (*FnAST))
+                        break;
+
+                    // Publish every prototype before codegen starts, since
+                    // workers only read the prototype map.
+                    previous_protos.push_back (function_protos.lookup (FnAST->get_name ()));
+                    FnAST->register_prototype (function_protos);
+                    defined_functions.insert (FnAST->get_name ());
+                    definitions.push_back (std::move(FnAST));
+                } else
+                    parser.synchronize ();
+                break;
+            case TOK_EXTERN:
+                handle_extern ();
+                break;
+            default:
+                if (auto FnAST = parser.parse_toplevel_expression ())
+                    toplevel_expressions.push_back (std::move(FnAST));
+                else
+                    parser.synchronize ();
+                break;
+        }
+    }
+
+    if (prints (OutputLevel::Summary))
+        fprintf (stderr, "Parsed %zu func. definitions\n", definitions.size ());
+
+    std::vector<CompiledDefinition> results (definitions.size ());
+    ThreadPool pool (hardware_concurrency (options.jobs));
+    size_t workers = std::min<size_t> (pool.getThreadCount (), definitions.size ());
+
+    // The time trace profiler is per thread, so each worker records its own.
+    bool trace_workers = timeTraceProfilerEnabled ();
+
+    for (size_t worker = 0; worker != workers; ++worker)
+        pool.async ([this, &definitions, &results, worker, workers, trace_workers] {
+            if (trace_workers)
+                timeTraceProfilerInitialize (time_trace_granularity, "lang");
+
+            {
+                TimeTraceScope trace ("CodegenWorker");
+                codegen_worker (definitions, results, worker, workers);
+            }
+
+            if (trace_workers)
+                timeTraceProfilerFinishThread ();
+        });
+    pool.wait ();
+
+    // Hand the results over in source order, so the output doesn't depend on
+    // how the definitions were scheduled.
+    for (size_t i = 0; i != results.size (); ++i) {
+        CompiledDefinition &result = results[i];
+        if (result.object) {
+            if (prints (OutputLevel::Summary))
+                fprintf (stderr, "Loaded the func. definition from the object cache\n");
+            exit_on_err (jit->addObjectFile (std::move(result.object)));
+            continue;
+        }
+
+        if (!result.module) {
+            // The body failed, so top-level code must not call it.
+            Symbol name = definitions[i]->get_name ();
+            defined_functions.erase (name);
+            if (previous_protos[i])
+                function_protos[name] = std::move(previous_protos[i]);
+            else
+                function_protos.erase (name);
+            continue;
+        }
+
+        fputs (result.ir.c_str (), stderr);
+        if (jit)
+            exit_on_err (jit->addIRModule (std::move(result.module)));
+        else
+            link_module (std::move(result.module));
+    }
+
+    for (auto &FnAST : toplevel_expressions) {
+        if (jit)
+            run_toplevel_expression (std::move(FnAST));
+        else
+            fprintf (stderr, "Warning: top-level expression ignored in -c mode\n");
+    }
+}
+
+/// The REPL prompt. Below the IR level it is only shown to a terminal.
+void Compiler::print_prompt () {
+    if (prints (OutputLevel::IR) || (prints (OutputLevel::Summary) && lexer.is_interactive ()))
+        fprintf (stderr, "input: ");
+}
+
+void Compiler::print_module () {
+    TimeRegion region (phase_timer (timers.get (), &PhaseTimers::print));
+    codegen->module->print(errs(), nullptr);
+}
+
+/// Prints the --time-report counters and phase timers.
+void Compiler::print_report () {
+    fprintf (stderr, "===-------------------------------------------------------------------------===\n");
+    fprintf (stderr, "                      Kaleidoscope compile statistics\n");
+    fprintf (stderr, "===-------------------------------------------------------------------------===\n");
+    fprintf (stderr, "%12llu tokens\n", (unsigned long long) lexer.get_num_tokens ());
+    fprintf (stderr, "%12llu AST nodes\n", (unsigned long long) parser.get_num_ast_nodes ());
+    fprintf (stderr, "%12llu IR instructions\n", (unsigned long long) num_ir_instructions.load ());
+    if (options.tier_up_threshold)
+        fprintf (stderr, "%12llu functions tiered up\n", (unsigned long long) num_tiered_up.load ());
+    fprintf (stderr, "\n");
+
+    if (timers)
+        timers->group.print (errs (), /*ResetAfterPrint=*/true);
+}
+
+bool Compiler::emit_object (StringRef filename) {
+    codegen->optimize_module ();
+
+    TimeTraceScope trace ("EmitObject");
+
+    std::error_code error;
+    ToolOutputFile out (filename, error, sys::fs::OF_None);
+    if (error) {
+        fprintf (stderr, "Error: could not open '%s': %s\n",
+                 filename.str().c_str(), error.message().c_str());
+        return false;
+    }
+
+    legacy::PassManager pass;
+    if (target_machine->addPassesToEmitFile (pass, out.os(), nullptr, CGFT_ObjectFile)) {
+        fprintf (stderr, "Error: target machine can't emit an object file\n");
+        return false;
+    }
+
+    pass.run (*codegen->module);
+    out.keep ();
+    return true;
+}
+
+// bench.cpp includes this file for its internals and brings its own main.
+#ifndef LANG_NO_MAIN
+int main (int argc, char **argv) {
+    cl::ParseCommandLineOptions (argc, argv, "Kaleidoscope JIT compiler\n");
+
+    CompilerOptions options;
+    if (!get_opt_level (options.opt_level)) {
+        fprintf (stderr, "Error: invalid optimization level -O%c\n", (char) opt_level);
+        return 1;
+    }
+
+    options.codegen_opt_level = get_codegen_opt_level ();
+    options.flat_ast = flat_ast;
+    options.fast_math = fast_math;
+    options.lazy = lazy;
+    options.interpret = interpret || tier_up;
+    options.tier_up_threshold = tier_up;
+    options.batch = batch;
+    options.async = async_compile;
+    options.compile_only = compile_only;
+    options.jobs = jobs;
+    options.time_report = time_report;
+    options.output_level = output_level;
+    options.cache_dir = cache_dir;
+    options.max_errors = max_errors;
+
+    if (options.interpret && compile_only) {
+        fprintf (stderr, "Error: --interpret can't be combined with -c\n");
+        return 1;
+    }
+
+    InitializeNativeTarget ();
+    InitializeNativeTargetAsmPrinter ();
+    InitializeNativeTargetAsmParser ();
+
+    if (!time_trace.empty ())
+        timeTraceProfilerInitialize (time_trace_granularity, argv[0]);
+
+    Compiler compiler (options);
+
+    if (!compiler.get_lexer().open_source (input_filename))
+        return 1;
+
+    compiler.print_prompt ();
 
-    main_loop ();
+    // Lazy mode already defers all codegen to the first call, the
+    // interpreter does none and --async runs it next to the input loop, so
+    // all of them keep the interactive loop.
+    if (options.jobs != 1 && !options.lazy && !options.interpret && !options.async)
+        compiler.parallel_loop ();
+    else
+        compiler.main_loop ();
+
+    compiler.finish_async_compiles ();
+
+    int exit_code = 0;
+    const Diagnostics &diagnostics = compiler.get_diagnostics ();
+    if (diagnostics.error_limit_reached () || (compile_only && diagnostics.get_error_count ())) {
+        // The input loop may have stopped part way, or some definitions are
+        // missing from the object file, so nothing is emitted.
+        exit_code = 1;
+    } else if (compile_only) {
+        SmallString<128> object_filename (output_filename);
+        if (object_filename.empty ()) {
+            object_filename = input_filename;
+            if (object_filename != "-")
+                sys::path::replace_extension (object_filename, "o");
+        }
+
+        exit_code = compiler.emit_object (object_filename) ? 0 : 1;
+    } else if (output_level == OutputLevel::IR && !options.interpret)
+        compiler.print_module ();
+
+    // The tier-up thread must be idle before its trace and counters are read.
+    compiler.stop_tier_up ();
 
-    the_module->print(errs(), nullptr);
-    return 0;
-}
\ No newline at end of file
+    if (time_report)
+        compiler.print_report ();
+
+    if (!time_trace.empty ()) {
+        exit_on_err (timeTraceProfilerWrite (time_trace, input_filename));
+        timeTraceProfilerCleanup ();
+    }
+
+    return exit_code;
+}
+#endif
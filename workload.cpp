@@ -0,0 +1,114 @@
+// Command-line front end of the synthetic workload generator. For example
+//
+//     ./workload -defs=10000 -call-graph=tree -seed=7 -o corpus.k
+//     ./workload -size=1G -depth=6 -literal-density=0.5 > huge.k
+//
+// writes a deterministic Kaleidoscope program for the benchmarks and scaling
+// runs of ./lang.
+
+#include "workload.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include <cstdio>
+
+using namespace llvm;
+
+static cl::opt<uint64_t> seed ("seed", cl::desc ("Seed of the generator (default = 1)"),
+                               cl::init (1));
+
+static cl::opt<uint64_t> num_defs (
+    "defs", cl::desc ("Number of definitions to emit (default = 100)"), cl::init (100));
+
+static cl::opt<std::string> target_size (
+    "size",
+    cl::desc ("Emit definitions until the output reaches this size instead, "
+              "e.g. 1K, 64M or 1G (overrides -defs)"),
+    cl::value_desc ("bytes"));
+
+static cl::opt<unsigned> num_externs (
+    "externs", cl::desc ("Number of libm externs to declare and call (at most 16, default = 4)"),
+    cl::init (4));
+
+static cl::opt<unsigned> max_args (
+    "max-args", cl::desc ("Every definition takes 1..N arguments (default = 4)"), cl::init (4));
+
+static cl::opt<unsigned> max_depth (
+    "depth", cl::desc ("Nesting depth of the expression in each body (default = 4)"),
+    cl::init (4));
+
+static cl::opt<unsigned> fanout (
+    "fanout", cl::desc ("Calls to other definitions per body (default = 2)"), cl::init (2));
+
+static cl::opt<workload::CallGraphShape> call_graph (
+    "call-graph",
+    cl::desc ("Which earlier definitions the calls of a body target (default = random)"),
+    cl::values (
+        clEnumValN (workload::CallGraphShape::None, "none", "No calls between definitions"),
+        clEnumValN (workload::CallGraphShape::Chain, "chain", "The definitions just before"),
+        clEnumValN (workload::CallGraphShape::Tree, "tree", "Ancestors in a binary tree"),
+        clEnumValN (workload::CallGraphShape::Random, "random", "Uniformly random earlier ones")),
+    cl::init (workload::CallGraphShape::Random));
+
+static cl::opt<double> literal_density (
+    "literal-density",
+    cl::desc ("Probability that an expression leaf is a literal rather than an argument "
+              "(default = 0.3)"),
+    cl::init (0.3));
+
+static cl::opt<uint64_t> num_toplevel (
+    "toplevel", cl::desc ("Top-level calls to append (default = 0)"), cl::init (0));
+
+static cl::opt<std::string> output_filename (
+    "o", cl::desc ("Output file (default = stdout)"), cl::value_desc ("filename"),
+    cl::init ("-"));
+
+/// Parses a byte count with an optional K, M or G (binary) suffix.
+static bool parse_size (StringRef text, uint64_t &size) {
+    unsigned shift = 0;
+    if (text.consume_back_insensitive ("k"))
+        shift = 10;
+    else if (text.consume_back_insensitive ("m"))
+        shift = 20;
+    else if (text.consume_back_insensitive ("g"))
+        shift = 30;
+
+    if (text.getAsInteger (10, size))
+        return false;
+
+    size <<= shift;
+    return true;
+}
+
+int main (int argc, char **argv) {
+    cl::ParseCommandLineOptions (argc, argv, "Kaleidoscope workload generator\n");
+
+    workload::Options options;
+    options.seed = seed;
+    options.num_defs = num_defs;
+    options.num_externs = num_externs;
+    options.max_args = max_args;
+    options.max_depth = max_depth;
+    options.fanout = fanout;
+    options.call_graph = call_graph;
+    options.literal_density = literal_density;
+    options.num_toplevel = num_toplevel;
+
+    if (!target_size.empty () && !parse_size (target_size, options.target_size)) {
+        fprintf (stderr, "Error: invalid size '%s'\n", target_size.c_str ());
+        return 1;
+    }
+
+    std::error_code error;
+    ToolOutputFile out (output_filename, error, sys::fs::OF_Text);
+    if (error) {
+        fprintf (stderr, "Error: could not open '%s': %s\n",
+                 output_filename.c_str (), error.message ().c_str ());
+        return 1;
+    }
+
+    workload::generate (options, out.os ());
+    out.keep ();
+    return 0;
+}
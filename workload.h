@@ -0,0 +1,193 @@
+// Deterministic generator of synthetic Kaleidoscope programs, shared by the
+// workload tool and the benchmarks. The same options and seed produce the same
+// bytes on every platform: the generator uses its own PRNG rather than the
+// implementation-defined <random> distributions.
+
+#ifndef LANG_WORKLOAD_H
+#define LANG_WORKLOAD_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace workload {
+
+// Which earlier definitions a definition's call sites target. Callees always
+// precede their callers, so every program also compiles eagerly.
+enum class CallGraphShape { None, Chain, Tree, Random };
+
+struct Options {
+    uint64_t seed = 1;
+    uint64_t num_defs = 100;
+    unsigned num_externs = 4;          // capped at the number of known libm functions
+    unsigned max_args = 4;             // each def takes 1..max_args arguments
+    unsigned max_depth = 4;            // nesting depth of the arithmetic part of a body
+    unsigned fanout = 2;               // call sites to other defs per body
+    CallGraphShape call_graph = CallGraphShape::Random;
+    double literal_density = 0.3;      // chance that an expression leaf is a literal
+    uint64_t num_toplevel = 0;         // top-level calls appended at the end
+    uint64_t target_size = 0;          // if set, emit defs until the output is this big
+};
+
+// splitmix64: tiny, fast and fully specified.
+class Random {
+    uint64_t state;
+
+    public:
+        explicit Random (uint64_t seed): state (seed) {}
+
+        uint64_t next () {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+
+        uint64_t below (uint64_t bound) { return next () % bound; }
+        bool chance (double probability) { return (next () >> 11) / 9007199254740992.0 < probability; }
+};
+
+struct ExternFunction {
+    const char *name;
+    unsigned arity;
+};
+
+// Functions the JIT resolves from the host's libm.
+static const ExternFunction known_externs[] = {
+    {"sin", 1},  {"cos", 1},   {"atan", 1},  {"exp", 1},   {"sqrt", 1}, {"fabs", 1},
+    {"floor", 1}, {"ceil", 1}, {"tanh", 1},  {"pow", 2},   {"fmod", 2}, {"atan2", 2},
+    {"hypot", 2}, {"fmin", 2}, {"fmax", 2},  {"copysign", 2},
+};
+
+class Generator {
+    const Options &options;
+    llvm::raw_ostream &out;
+    Random random;
+    llvm::ArrayRef<ExternFunction> externs;
+    std::vector<uint32_t> def_arity;
+
+    void emit_literal () {
+        out << random.below (100) << '.' << random.below (100);
+    }
+
+    void emit_leaf (unsigned arity) {
+        if (arity == 0 || random.chance (options.literal_density))
+            emit_literal ();
+        else
+            out << 'a' << random.below (arity);
+    }
+
+    void emit_args (unsigned count, unsigned depth, unsigned arity) {
+        out << '(';
+        for (unsigned arg = 0; arg != count; ++arg) {
+            if (arg)
+                out << ", ";
+            emit_expression (depth, arity);
+        }
+        out << ')';
+    }
+
+    void emit_expression (unsigned depth, unsigned arity) {
+        if (depth == 0 || (depth < options.max_depth && random.chance (0.3))) {
+            emit_leaf (arity);
+            return;
+        }
+
+        if (!externs.empty () && random.chance (0.15)) {
+            const ExternFunction &callee = externs[random.below (externs.size ())];
+            out << callee.name;
+            emit_args (callee.arity, depth - 1, arity);
+            return;
+        }
+
+        static const char ops[] = {'+', '-', '*', '+', '*', '<'};
+        bool parenthesize = random.chance (0.5);
+
+        if (parenthesize)
+            out << '(';
+        emit_expression (depth - 1, arity);
+        out << ' ' << ops[random.below (sizeof (ops))] << ' ';
+        emit_expression (depth - 1, arity);
+        if (parenthesize)
+            out << ')';
+    }
+
+    uint64_t pick_callee (uint64_t caller, unsigned call, uint64_t previous) {
+        switch (options.call_graph) {
+        case CallGraphShape::Chain:
+            return call < caller ? caller - 1 - call : 0;
+        case CallGraphShape::Tree:
+            // A binary tree: the first call goes to the parent, later ones
+            // further up the same path.
+            return (call == 0 ? caller - 1 : previous) / 2;
+        case CallGraphShape::Random:
+        default:
+            return random.below (caller);
+        }
+    }
+
+    void emit_definition (uint64_t index) {
+        unsigned arity = 1 + random.below (options.max_args ? options.max_args : 1);
+        def_arity.push_back (arity);
+
+        out << "def f" << index << '(';
+        for (unsigned arg = 0; arg != arity; ++arg)
+            out << (arg ? " a" : "a") << arg;
+        out << ") ";
+
+        emit_expression (options.max_depth, arity);
+
+        if (options.call_graph != CallGraphShape::None && index > 0) {
+            uint64_t callee = index;
+            for (unsigned call = 0; call != options.fanout; ++call) {
+                callee = pick_callee (index, call, callee);
+                out << " + f" << callee;
+                emit_args (def_arity[callee], 1, arity);
+            }
+        }
+
+        out << ";\n";
+    }
+
+    public:
+        Generator (const Options &options, llvm::raw_ostream &out)
+            : options (options), out (out), random (options.seed) {
+            size_t num_externs = std::min<size_t> (options.num_externs,
+                                                   sizeof (known_externs) / sizeof (known_externs[0]));
+            externs = llvm::makeArrayRef (known_externs, num_externs);
+        }
+
+        void run () {
+            uint64_t start = out.tell ();
+
+            for (const ExternFunction &callee : externs) {
+                out << "extern " << callee.name << '(';
+                for (unsigned arg = 0; arg != callee.arity; ++arg)
+                    out << (arg ? " x" : "x") << arg;
+                out << ");\n";
+            }
+
+            for (uint64_t index = 0; options.target_size ? out.tell () - start < options.target_size
+                                                         : index < options.num_defs;
+                 ++index)
+                emit_definition (index);
+
+            for (uint64_t expr = 0; expr != options.num_toplevel && !def_arity.empty (); ++expr) {
+                uint64_t callee = random.below (def_arity.size ());
+                out << 'f' << callee;
+                emit_args (def_arity[callee], 0, 0);
+                out << ";\n";
+            }
+        }
+};
+
+/// Writes the program described by `options` to `out`.
+inline void generate (const Options &options, llvm::raw_ostream &out) {
+    Generator (options, out).run ();
+}
+
+}
+
+#endif